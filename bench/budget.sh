@@ -0,0 +1,90 @@
+#!/bin/sh
+# X request budgets of securezone against Xvfb
+#
+# Starts a TEST build of securezone with --trace-startup on Xvfb, checks
+# the round trips of its startup, then drives it with securezone-stress -B
+# and checks the requests and bytes per keystroke, per expose and per
+# failed attempt. Exits non-zero when any of them is over budget or could
+# not be measured, so a change that makes a hot path chattier shows up.
+#
+# usage: bench/budget.sh [binary] [stress binary]
+#   DISPNUM  display number used for Xvfb (default 99)
+#   GEOMETRY geometry of the X screen (default 1280x1024x24)
+#   budgets, as maximum per event:
+#   ROUND_TRIPS   startup round trips after connecting (default 8)
+#   KEY_REQS      KEY_BYTES      (default 4 and 96)
+#   EXPOSE_REQS   EXPOSE_BYTES   (default 16 and 384)
+#   ATTEMPT_REQS  ATTEMPT_BYTES  (default 24 and 512)
+
+BIN=${1:-./securezone-budget}
+STRESS=${2:-./securezone-stress}
+DISPNUM=${DISPNUM:-99}
+GEOMETRY=${GEOMETRY:-1280x1024x24}
+ROUND_TRIPS=${ROUND_TRIPS:-8}
+KEY_REQS=${KEY_REQS:-4};         KEY_BYTES=${KEY_BYTES:-96}
+EXPOSE_REQS=${EXPOSE_REQS:-16};  EXPOSE_BYTES=${EXPOSE_BYTES:-384}
+ATTEMPT_REQS=${ATTEMPT_REQS:-24}; ATTEMPT_BYTES=${ATTEMPT_BYTES:-512}
+
+TMP=$(mktemp -d) || exit 1
+trap 'kill $locker $xvfb 2>/dev/null; rm -rf "$TMP"' EXIT
+
+if ! command -v Xvfb >/dev/null 2>&1; then
+    echo "ERROR: Xvfb is needed for the budget checks" >&2
+    exit 1
+fi
+
+Xvfb :$DISPNUM -screen 0 "$GEOMETRY" -nolisten tcp >/dev/null 2>&1 &
+xvfb=$!
+i=0
+while [ ! -S /tmp/.X11-unix/X$DISPNUM ] && [ $i -lt 50 ]; do
+    sleep 0.1
+    i=$((i + 1))
+done
+
+DISPLAY=:$DISPNUM "$BIN" --trace-startup 2> "$TMP/trace" &
+locker=$!
+i=0
+while ! grep -q '^phase frame ' "$TMP/trace" && [ $i -lt 50 ]; do
+    sleep 0.1
+    i=$((i + 1))
+done
+if ! grep -q '^phase frame ' "$TMP/trace"; then
+    echo "ERROR: securezone never showed its first frame" >&2
+    exit 1
+fi
+
+DISPLAY=:$DISPNUM "$STRESS" -p $locker -B > "$TMP/budget" || exit 1
+kill $locker
+wait $locker 2>/dev/null
+
+failed=0
+
+# check name value budget
+check() {
+    if awk -v v=$2 -v b=$3 'BEGIN { exit !(v > b) }'; then
+        status=OVER
+        failed=1
+    else
+        status=ok
+    fi
+    printf '%-16s %10s %10s  %s\n' $1 $2 $3 $status
+}
+
+printf '%-16s %10s %10s\n' check value budget
+check startup_trips $(awk '$1 == "phase" && $2 != "open" { n += $5 } END { print n + 0 }' \
+    "$TMP/trace") $ROUND_TRIPS
+for name in key expose attempt; do
+    set -- $(awk -v n=$name '$1 == "budget" && $2 == n { print $3, $4; exit }' "$TMP/budget")
+    if [ $# -ne 2 ]; then
+        printf '%-16s %10s %10s  %s\n' $name - - MISSING
+        failed=1
+        continue
+    fi
+    case $name in
+        key) check key_reqs $1 $KEY_REQS; check key_bytes $2 $KEY_BYTES ;;
+        expose) check expose_reqs $1 $EXPOSE_REQS; check expose_bytes $2 $EXPOSE_BYTES ;;
+        attempt) check attempt_reqs $1 $ATTEMPT_REQS; check attempt_bytes $2 $ATTEMPT_BYTES ;;
+    esac
+done
+
+exit $failed
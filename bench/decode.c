@@ -0,0 +1,159 @@
+/* securezone-decode - Microbenchmark of the image decoders
+ *
+ * Copyright 2015 Pontus Andersson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Decodes the three bundled images and synthetic 4K backdrops with every
+ * kernel this CPU supports, checks the result against the scalar kernel
+ * and prints the best time of a decode as
+ *
+ *   decode <image> <kernel> <pixels> <us> <Mpixels/s>
+ *
+ * usage: securezone-decode [-r repeats] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "../images/decode.h"
+
+#define REPEATS 50
+
+typedef struct {
+    const char *name;
+    unsigned int width, height;
+    char *data;
+} Image;
+
+int repeats = REPEATS;
+
+long long now_us(void);
+void die(const char *msg);
+char *synthetic(unsigned int w, unsigned int h);
+void bench(const Image *image);
+
+#define IMAGE_HEADER_BEGIN(name) void load_##name(Image *image) {
+#define IMAGE_HEADER_END(name) *image = (Image){ #name, width, height, header_data }; }
+
+IMAGE_HEADER_BEGIN(message)
+#include "../images/message.h"
+    IMAGE_HEADER_END(message)
+
+IMAGE_HEADER_BEGIN(granted)
+#include "../images/access_granted.h"
+    IMAGE_HEADER_END(granted)
+
+IMAGE_HEADER_BEGIN(denied)
+#include "../images/access_denied.h"
+    IMAGE_HEADER_END(denied)
+
+long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000);
+}
+
+void die(const char *msg)
+{
+    fprintf(stderr, "securezone-decode: %s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+char *synthetic(unsigned int w, unsigned int h)
+{
+    unsigned int i, c = w * h * 4;
+    char *data;
+
+    if(!(data = malloc(c)))
+        die("out of memory");
+
+    /* Noise, so no kernel gets to profit from runs of equal pixels */
+    srand(w ^ h);
+    for(i = 0; i < c; i++)
+        data[i] = 33 + (rand() & 0x3F);
+
+    return data;
+}
+
+void bench(const Image *image)
+{
+    const Decoder *d;
+    unsigned int c = image->width * image->height;
+    unsigned int *want, *got;
+    long long start, t, best;
+    int i;
+
+    if(!(want = malloc(c * sizeof(unsigned int))) || !(got = malloc(c * sizeof(unsigned int))))
+        die("out of memory");
+    decode_scalar(want, image->data, c);
+
+    for(d = decoders(); d->name; d++) {
+        memset(got, 0, c * sizeof(unsigned int));
+        d->decode(got, image->data, c);
+        if(memcmp(got, want, c * sizeof(unsigned int))) {
+            fprintf(stderr, "securezone-decode: %s decodes %s wrong\n", d->name, image->name);
+            exit(EXIT_FAILURE);
+        }
+
+        best = -1;
+        for(i = 0; i < repeats; i++) {
+            start = now_us();
+            d->decode(got, image->data, c);
+            t = now_us() - start;
+            if(best < 0 || t < best)
+                best = t;
+        }
+        printf("decode %s %s %u %lld %.1f\n", image->name, d->name, c, best,
+                best ? (double)c / best : 0.0);
+    }
+
+    free(want);
+    free(got);
+}
+
+int main(int argc, char **argv)
+{
+    Image images[5];
+    int opt, i;
+
+    while((opt = getopt(argc, argv, "r:")) != -1) {
+        switch(opt) {
+            case 'r':
+                if((repeats = atoi(optarg)) < 1)
+                    die("repeats must be a positive number");
+                break;
+            default:
+                fprintf(stderr, "usage: securezone-decode [-r repeats]\n");
+                return EXIT_FAILURE;
+        }
+    }
+
+    load_message(&images[0]);
+    load_granted(&images[1]);
+    load_denied(&images[2]);
+    images[3] = (Image){ "uhd-4k", 3840, 2160, synthetic(3840, 2160) };
+    images[4] = (Image){ "dci-4k", 4096, 2160, synthetic(4096, 2160) };
+
+    for(i = 0; i < 5; i++)
+        bench(&images[i]);
+
+    free(images[3].data);
+    free(images[4].data);
+
+    return EXIT_SUCCESS;
+}
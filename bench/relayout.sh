@@ -0,0 +1,63 @@
+#!/bin/sh
+# RandR relayout check of securezone against Xvfb
+#
+# Starts a TEST build of securezone with -V on Xvfb, changes the size of
+# the screen with xrandr and checks that securezone follows it with a
+# relayout. Exits non-zero when it does not.
+#
+# usage: bench/relayout.sh [binary]
+#   DISPNUM  display number used for Xvfb (default 99)
+#   GEOMETRY geometry of the X screen (default 1280x1024x24)
+#   RESIZE   size the screen is changed to (default 1024x768)
+
+BIN=${1:-./securezone-budget}
+DISPNUM=${DISPNUM:-99}
+GEOMETRY=${GEOMETRY:-1280x1024x24}
+RESIZE=${RESIZE:-1024x768}
+
+TMP=$(mktemp -d) || exit 1
+trap 'kill $locker $xvfb 2>/dev/null; rm -rf "$TMP"' EXIT
+
+for tool in Xvfb xrandr; do
+    if ! command -v $tool >/dev/null 2>&1; then
+        echo "ERROR: $tool is needed for the relayout check" >&2
+        exit 1
+    fi
+done
+
+Xvfb :$DISPNUM -screen 0 "$GEOMETRY" +extension RANDR -nolisten tcp >/dev/null 2>&1 &
+xvfb=$!
+i=0
+while [ ! -S /tmp/.X11-unix/X$DISPNUM ] && [ $i -lt 50 ]; do
+    sleep 0.1
+    i=$((i + 1))
+done
+
+DISPLAY=:$DISPNUM "$BIN" -V --trace-startup 2> "$TMP/log" &
+locker=$!
+i=0
+while ! grep -q '^phase frame ' "$TMP/log" && [ $i -lt 50 ]; do
+    sleep 0.1
+    i=$((i + 1))
+done
+if ! grep -q '^phase frame ' "$TMP/log"; then
+    echo "ERROR: securezone never showed its first frame" >&2
+    exit 1
+fi
+
+if ! DISPLAY=:$DISPNUM xrandr --fb "$RESIZE" >/dev/null 2>&1; then
+    echo "ERROR: Xvfb could not be resized to $RESIZE" >&2
+    exit 1
+fi
+
+i=0
+while ! grep -q 'Relayout to ' "$TMP/log" && [ $i -lt 50 ]; do
+    sleep 0.1
+    i=$((i + 1))
+done
+if ! grep -q 'Relayout to ' "$TMP/log"; then
+    echo "FAILED: no relayout after resizing to $RESIZE" >&2
+    exit 1
+fi
+
+echo "relayout ok: $(grep -m 1 'Relayout to ' "$TMP/log")"
@@ -0,0 +1,52 @@
+#!/bin/sh
+# Repaint benchmark of securezone against Xvfb
+#
+# Runs a securezone built with -DBENCH on Xinerama walls of 1 to 12 heads,
+# once drawing from the main connection and once with -w render workers,
+# and prints the mean wall time of repainting every head.
+#
+# usage: bench/repaint.sh [binary]
+#   HEADS    head counts to run (default "1 2 4 8 12")
+#   DISPNUM  display number used for Xvfb (default 99)
+#   GEOMETRY geometry of every head (default 1280x1024x24)
+
+BIN=${1:-./securezone-bench}
+HEADS=${HEADS:-1 2 4 8 12}
+DISPNUM=${DISPNUM:-99}
+GEOMETRY=${GEOMETRY:-1280x1024x24}
+
+if ! command -v Xvfb >/dev/null 2>&1; then
+    echo "ERROR: Xvfb is needed for the repaint benchmark" >&2
+    exit 1
+fi
+
+# screen arguments for Xvfb with $1 screens
+screen_args() {
+    i=0
+    while [ $i -lt $1 ]; do
+        printf -- '-screen %d %s ' $i "$GEOMETRY"
+        i=$((i + 1))
+    done
+}
+
+# repaint time in ms of $BIN with the arguments given
+repaint() {
+    DISPLAY=:$DISPNUM "$BIN" "$@" 2>&1 >/dev/null \
+        | awk '$1 == "repaint" { printf "%.3f", $4 / 1000 }'
+}
+
+printf '%-6s %12s %12s\n' heads serial_ms workers_ms
+for num in $HEADS; do
+    Xvfb :$DISPNUM $(screen_args $num) +xinerama -nolisten tcp >/dev/null 2>&1 &
+    xvfb=$!
+    i=0
+    while [ ! -S /tmp/.X11-unix/X$DISPNUM ] && [ $i -lt 50 ]; do
+        sleep 0.1
+        i=$((i + 1))
+    done
+
+    printf '%-6d %12s %12s\n' $num "$(repaint)" "$(repaint -w)"
+
+    kill $xvfb
+    wait $xvfb 2>/dev/null
+done
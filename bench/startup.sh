@@ -0,0 +1,113 @@
+#!/bin/sh
+# Startup benchmark of securezone against Xvfb
+#
+# Runs a securezone built with -DBENCH with --trace-startup a number of
+# times on Xvfb with 1, 2, 4 and 8 X screens and on Xinerama layouts, and
+# writes the percentiles of every startup phase it traces, in ms since
+# main, and of the round trips every phase took to a JSON report.
+#
+# usage: bench/startup.sh [binary]
+#   RUNS     runs per layout (default 50)
+#   REPORT   report file (default startup.json)
+#   DISPNUM  display number used for Xvfb (default 99)
+#   GEOMETRY geometry of every X screen (default 1280x1024x24)
+
+BIN=${1:-./securezone-bench}
+RUNS=${RUNS:-50}
+REPORT=${REPORT:-startup.json}
+DISPNUM=${DISPNUM:-99}
+GEOMETRY=${GEOMETRY:-1280x1024x24}
+
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+if ! command -v Xvfb >/dev/null 2>&1; then
+    echo "ERROR: Xvfb is needed for the startup benchmark" >&2
+    exit 1
+fi
+
+# screen arguments for Xvfb with $1 screens
+screen_args() {
+    i=0
+    while [ $i -lt $1 ]; do
+        printf -- '-screen %d %s ' $i "$GEOMETRY"
+        i=$((i + 1))
+    done
+}
+
+# percentiles in ms of the usec values on stdin
+percentiles() {
+    sort -n | awk '
+        { v[NR] = $1 }
+        function p(q,  i) { i = int(q * (NR - 1) + 0.5) + 1; return v[i] / 1000 }
+        END {
+            if(NR == 0) { printf "null"; exit }
+            printf "{\"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}",
+                v[1] / 1000, p(.5), p(.9), p(.99), v[NR] / 1000
+        }'
+}
+
+# percentiles of the counts on stdin
+counts() {
+    sort -n | awk '
+        { v[NR] = $1 }
+        function p(q) { return v[int(q * (NR - 1) + 0.5) + 1] }
+        END {
+            if(NR == 0) { printf "null"; exit }
+            printf "{\"min\": %d, \"p50\": %d, \"p90\": %d, \"p99\": %d, \"max\": %d}",
+                v[1], p(.5), p(.9), p(.99), v[NR]
+        }'
+}
+
+# run_layout name screens [xvfb args]
+run_layout() {
+    name=$1; num=$2; shift 2
+    log="$TMP/$name.log"
+
+    Xvfb :$DISPNUM $(screen_args $num) "$@" -nolisten tcp >/dev/null 2>&1 &
+    xvfb=$!
+    i=0
+    while [ ! -S /tmp/.X11-unix/X$DISPNUM ] && [ $i -lt 50 ]; do
+        sleep 0.1
+        i=$((i + 1))
+    done
+
+    i=0
+    : > "$log"
+    while [ $i -lt $RUNS ]; do
+        DISPLAY=:$DISPNUM "$BIN" --trace-startup 2>&1 >/dev/null | grep '^phase ' >> "$log"
+        i=$((i + 1))
+    done
+
+    kill $xvfb
+    wait $xvfb 2>/dev/null
+
+    printf '    "%s": {\n' "$name"
+    printf '      "screens": %d,\n      "runs": %d' $num $RUNS
+    # Every phase traced, in the order they first appear
+    for phase in $(awk '!seen[$2]++ { print $2 }' "$log"); do
+        printf ',\n      "%s": ' $phase
+        awk -v p=$phase '$2 == p { print $3 }' "$log" | percentiles
+        printf ',\n      "%s_round_trips": ' $phase
+        awk -v p=$phase '$2 == p { print $5 }' "$log" | counts
+    done
+    printf '\n    }'
+}
+
+{
+    printf '{\n  "unit": "ms since main",\n  "round_trips_unit": "round trips",\n  "layouts": {\n'
+    run_layout screens-1 1
+    printf ',\n'
+    run_layout screens-2 2
+    printf ',\n'
+    run_layout screens-4 4
+    printf ',\n'
+    run_layout screens-8 8
+    printf ',\n'
+    run_layout xinerama-2 2 +xinerama
+    printf ',\n'
+    run_layout xinerama-4 4 +xinerama
+    printf '\n  }\n}\n'
+} > "$REPORT"
+
+echo "Startup report written to $REPORT"
@@ -0,0 +1,407 @@
+/* securezone-stress - Load harness for a running securezone
+ *
+ * Copyright 2015 Pontus Andersson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Connects to the display of a running securezone (best a TEST build on
+ * Xvfb) and drives it with XTest: typing storms, autorepeated BackSpace,
+ * pointer motion storms and a second client churning windows. The
+ * requests of securezone are counted with the RECORD extension, and every
+ * workload reports securezone's CPU time, its request rate and how fast
+ * it reacts to a probe keystroke by drawing.
+ *
+ * With -B it instead measures the requests and bytes securezone sends per
+ * keystroke, per expose and per failed attempt (a TEST build denies
+ * anything but "test"), checked against budgets by bench/budget.sh. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <X11/Xlib.h>
+#include <X11/Xproto.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XTest.h>
+#include <X11/extensions/record.h>
+
+#define BURST 16 /* keys typed before deleting them again */
+#define PROBE_INTERVAL 100000 /* us between probes of a storm */
+#define MAX_PROBES 4096
+#define QUIET 200000 /* us without requests before securezone is settled */
+#define BUDGET_STEPS 20
+
+typedef struct {
+    const char *name;
+    long interval; /* us between two steps */
+    void (*step)(long i);
+} Workload;
+
+Display *dpy, *rdpy, *cdpy;
+Window locker, churn;
+KeyCode key_a, key_backspace, key_return;
+int width, height, pid, seconds = 10, budget_mode;
+
+/* counted from the record stream */
+unsigned long requests, bytes;
+long long probe_start, latency[MAX_PROBES];
+int num_latency;
+
+void exit_error(const char *error_str, ...);
+long long now_us(void);
+long cpu_ms(void);
+Window find_locker(void);
+void record_cb(XPointer priv, XRecordInterceptData *data);
+void key(KeyCode code);
+void probe(long i);
+void step_typing(long i);
+void step_backspace(long i);
+void step_pointer(long i);
+void step_churn(long i);
+void run(Workload *w);
+int cmp_latency(const void *a, const void *b);
+void settle(void);
+void budget(const char *name, void (*step)(long i));
+void budget_key(long i);
+void budget_expose(long i);
+void budget_attempt(long i);
+
+Workload workloads[] = {
+    { "typing", 5000, step_typing },
+    { "backspace", 30000, step_backspace },
+    { "pointer", 1000, step_pointer },
+    { "churn", 2000, step_churn },
+};
+
+int main(int argc, char **argv)
+{
+    XRecordClientSpec client;
+    XRecordRange *range;
+    XRecordContext rc;
+    int i, dummy;
+
+    for(i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+            pid = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+            seconds = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-B") == 0)
+            budget_mode = 1;
+        else
+            break;
+    }
+    if(i < argc || pid <= 0 || seconds <= 0) {
+        fprintf(stderr, "usage: securezone-stress -p pid [-d seconds] [-B]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Workload, record data and churn client each get a connection */
+    if(!(dpy = XOpenDisplay(0)) || !(rdpy = XOpenDisplay(0)) || !(cdpy = XOpenDisplay(0)))
+        exit_error("Could not open display");
+    if(!XTestQueryExtension(dpy, &dummy, &dummy, &dummy, &dummy))
+        exit_error("XTEST extension missing");
+    if(!XRecordQueryVersion(dpy, &dummy, &dummy))
+        exit_error("RECORD extension missing");
+
+    width = DisplayWidth(dpy, DefaultScreen(dpy));
+    height = DisplayHeight(dpy, DefaultScreen(dpy));
+    key_a = XKeysymToKeycode(dpy, XK_a);
+    key_backspace = XKeysymToKeycode(dpy, XK_BackSpace);
+    key_return = XKeysymToKeycode(dpy, XK_Return);
+
+    if(!(locker = find_locker()))
+        exit_error("No securezone window found");
+
+    /* Any resource of a client selects that client */
+    client = locker;
+    range = XRecordAllocRange();
+    range->core_requests.first = X_CreateWindow;
+    range->core_requests.last = X_NoOperation;
+    if(!(rc = XRecordCreateContext(dpy, 0, &client, 1, &range, 1)))
+        exit_error("Could not create record context");
+    XSync(dpy, False);
+    if(!XRecordEnableContextAsync(rdpy, rc, record_cb, NULL))
+        exit_error("Could not enable record context");
+
+    if(budget_mode) {
+        budget("key", budget_key);
+        budget("expose", budget_expose);
+        budget("attempt", budget_attempt);
+    } else {
+        printf("%-10s %8s %8s %10s %10s %7s %9s %9s\n", "workload", "seconds",
+                "cpu_ms", "req/s", "bytes/s", "probes", "p50_ms", "max_ms");
+        for(i = 0; i < sizeof workloads / sizeof workloads[0]; i++)
+            run(&workloads[i]);
+    }
+
+    XRecordDisableContext(dpy, rc);
+    XRecordFreeContext(dpy, rc);
+    XFree(range);
+    XCloseDisplay(cdpy);
+    XCloseDisplay(rdpy);
+    XCloseDisplay(dpy);
+
+    return EXIT_SUCCESS;
+}
+
+void exit_error(const char *error_str, ...)
+{
+    va_list ap;
+    va_start(ap, error_str);
+    fprintf(stderr, "ERROR: ");
+    vfprintf(stderr, error_str, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    exit(EXIT_FAILURE);
+}
+
+long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000);
+}
+
+long cpu_ms(void)
+{
+    char path[64], buf[1024], *p;
+    unsigned long utime, stime;
+    FILE *f;
+
+    snprintf(path, sizeof path, "/proc/%d/stat", pid);
+    if(!(f = fopen(path, "r")))
+        exit_error("securezone (pid %d) is gone", pid);
+    p = fgets(buf, sizeof buf, f);
+    fclose(f);
+
+    /* utime and stime are fields 14 and 15, counted after the comm */
+    if(!p || !(p = strrchr(buf, ')'))
+            || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                &utime, &stime) != 2)
+        exit_error("Could not read %s", path);
+
+    return ((utime + stime) * 1000) / sysconf(_SC_CLK_TCK);
+}
+
+Window find_locker(void)
+{
+    XWindowAttributes wa;
+    Window root, parent, *children, found = None;
+    unsigned int n;
+
+    /* The topmost mapped override redirect window is securezone */
+    if(!XQueryTree(dpy, DefaultRootWindow(dpy), &root, &parent, &children, &n))
+        return None;
+    while(n-- > 0 && !found)
+        if(XGetWindowAttributes(dpy, children[n], &wa) && wa.override_redirect
+                && wa.map_state == IsViewable)
+            found = children[n];
+    XFree(children);
+
+    return found;
+}
+
+void record_cb(XPointer priv, XRecordInterceptData *data)
+{
+    if(data->category == XRecordFromClient) {
+        requests++;
+        bytes += data->data_len * 4;
+
+        /* The first fill after a probe is the reaction to it */
+        if(probe_start && data->data[0] == X_PolyFillRectangle) {
+            if(num_latency < MAX_PROBES)
+                latency[num_latency++] = now_us() - probe_start;
+            probe_start = 0;
+        }
+    }
+    XRecordFreeData(data);
+}
+
+void key(KeyCode code)
+{
+    XTestFakeKeyEvent(dpy, code, True, CurrentTime);
+    XTestFakeKeyEvent(dpy, code, False, CurrentTime);
+}
+
+void probe(long i)
+{
+    /* Type and delete every other probe, the input never grows */
+    if(!probe_start)
+        probe_start = now_us();
+    key(i % 2 ? key_backspace : key_a);
+}
+
+void step_typing(long i)
+{
+    if(!probe_start)
+        probe_start = now_us();
+    key((i / BURST) % 2 ? key_backspace : key_a);
+}
+
+void step_backspace(long i)
+{
+    /* Fill the field, then BackSpace at autorepeat rate */
+    if(!probe_start)
+        probe_start = now_us();
+    key(i % (BURST * 2) < BURST ? key_a : key_backspace);
+}
+
+void step_pointer(long i)
+{
+    XTestFakeMotionEvent(dpy, -1, rand() % width, rand() % height, CurrentTime);
+    if(i % (PROBE_INTERVAL / 1000) == 0)
+        probe(i / (PROBE_INTERVAL / 1000));
+}
+
+void step_churn(long i)
+{
+    XSetWindowAttributes wa = {0};
+
+    if(churn) {
+        XDestroyWindow(cdpy, churn);
+        churn = None;
+    } else {
+        wa.background_pixel = BlackPixel(cdpy, DefaultScreen(cdpy));
+        churn = XCreateWindow(cdpy, DefaultRootWindow(cdpy),
+                rand() % width, rand() % height, 1 + rand() % 400, 1 + rand() % 300,
+                0, CopyFromParent, InputOutput, CopyFromParent, CWBackPixel, &wa);
+        XMapRaised(cdpy, churn);
+    }
+    XFlush(cdpy);
+
+    if(i % (PROBE_INTERVAL / 2000) == 0)
+        probe(i / (PROBE_INTERVAL / 2000));
+}
+
+void run(Workload *w)
+{
+    unsigned long start_requests, start_bytes;
+    long long start, end, next, left;
+    long start_cpu, cpu, i = 0;
+    double wall;
+
+    /* Leave the input empty and let securezone settle */
+    while(probe_start && now_us() - probe_start < 1000000)
+        XRecordProcessReplies(rdpy);
+    probe_start = 0;
+    num_latency = 0;
+    start_requests = requests;
+    start_bytes = bytes;
+    start_cpu = cpu_ms();
+
+    start = next = now_us();
+    end = start + (seconds * 1000000LL);
+    while(now_us() < end) {
+        w->step(i++);
+        XFlush(dpy);
+        next += w->interval;
+        while((left = next - now_us()) > 0) {
+            XRecordProcessReplies(rdpy);
+            usleep(left < 500 ? left : 500);
+        }
+    }
+    if(churn) {
+        XDestroyWindow(cdpy, churn);
+        churn = None;
+        XFlush(cdpy);
+    }
+    XSync(dpy, False);
+    usleep(100000);
+    XRecordProcessReplies(rdpy);
+
+    cpu = cpu_ms() - start_cpu;
+    wall = (now_us() - start) / 1000000.0;
+    qsort(latency, num_latency, sizeof latency[0], cmp_latency);
+    printf("%-10s %8.2f %8ld %10.0f %10.0f %7d %9.2f %9.2f\n", w->name, wall, cpu,
+            (requests - start_requests) / wall, (bytes - start_bytes) / wall, num_latency,
+            num_latency ? latency[num_latency / 2] / 1000.0 : 0,
+            num_latency ? latency[num_latency - 1] / 1000.0 : 0);
+    fflush(stdout);
+}
+
+int cmp_latency(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+void settle(void)
+{
+    unsigned long last = requests;
+    long long since = now_us();
+
+    /* Settled once securezone sent nothing for QUIET us */
+    while(now_us() - since < QUIET) {
+        XRecordProcessReplies(rdpy);
+        if(requests != last) {
+            last = requests;
+            since = now_us();
+        }
+        usleep(1000);
+    }
+}
+
+void budget(const char *name, void (*step)(long i))
+{
+    unsigned long start_requests, start_bytes;
+    long i;
+
+    settle();
+    start_requests = requests;
+    start_bytes = bytes;
+    for(i = 0; i < BUDGET_STEPS; i++) {
+        step(i);
+        XFlush(dpy);
+        settle();
+    }
+
+    printf("budget %s %.1f %.1f\n", name,
+            (requests - start_requests) / (double)BUDGET_STEPS,
+            (bytes - start_bytes) / (double)BUDGET_STEPS);
+    fflush(stdout);
+}
+
+void budget_key(long i)
+{
+    /* Type and delete, the input never grows */
+    key(i % 2 ? key_backspace : key_a);
+}
+
+void budget_expose(long i)
+{
+    XSetWindowAttributes wa = {0};
+    Window w;
+
+    /* Cover and uncover the middle, where the message and field are */
+    wa.override_redirect = True;
+    wa.background_pixel = BlackPixel(cdpy, DefaultScreen(cdpy));
+    w = XCreateWindow(cdpy, DefaultRootWindow(cdpy), width / 4, height / 4,
+            width / 2, height / 2, 0, CopyFromParent, InputOutput, CopyFromParent,
+            CWOverrideRedirect | CWBackPixel, &wa);
+    XMapRaised(cdpy, w);
+    XFlush(cdpy);
+    settle();
+    XDestroyWindow(cdpy, w);
+    XFlush(cdpy);
+}
+
+void budget_attempt(long i)
+{
+    /* One wrong character and Return */
+    key(key_a);
+    key(key_return);
+}
@@ -3,14 +3,16 @@ PREFIX = /usr/local
 
 # includes and libs
 INCS = -I/usr/include
-LIBS = -lX11 -lXext -lXinerama -lpam
+LIBS = -lX11 -lX11-xcb -lxcb -lxcb-dpms -lxcb-randr -lxcb-shm -lxcb-xinerama -lXext -lXrandr -lXss -lpam -lpthread
 
 # flags
 CFLAGS = ${DEBUG} -Wall -Os ${INCS} \
 		 -DPREFIX=\"$(PREFIX)\" \
 		 -DVERSION=\"${VERSION}\"
 LDFLAGS = ${DEBUG} ${LIBS}
+STRESS_LDFLAGS = ${DEBUG} -lX11 -lXtst
 
 # compiler and linker
 CC = cc
 LD = ${CC}
+HOSTCC = ${CC}
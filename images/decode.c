@@ -0,0 +1,109 @@
+/* decode - Decoders of the GIMP C header pixel encoding
+ *
+ * Copyright 2015 Pontus Andersson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Every pixel is 4 characters of 6 bits offset by 33, together the 24
+ * bits of 0x00RRGGBB from the most significant end. The SIMD kernels
+ * are compiled with target attributes, so no special flags are needed,
+ * and picked at runtime by what the CPU supports. */
+
+#include "decode.h"
+
+#ifdef DECODE_SIMD
+#include <immintrin.h>
+#endif
+
+void decode_scalar(unsigned int *dst, const char *src, unsigned int n)
+{
+    unsigned int i;
+    unsigned int r, g, b;
+
+    for(i = 0; i < n; i++) {
+        r = (((src[0] - 33) << 2) | ((src[1] - 33) >> 4)) & 0xFF;
+        g = ((((src[1] - 33) & 0xF) << 4) | ((src[2] - 33) >> 2)) & 0xFF;
+        b = ((((src[2] - 33) & 0x3) << 6) | ((src[3] - 33))) & 0xFF;
+        dst[i] = (r << 16) | (g << 8) | b;
+        src += 4;
+    }
+}
+
+#ifdef DECODE_SIMD
+__attribute__((target("sse2")))
+void decode_sse2(unsigned int *dst, const char *src, unsigned int n)
+{
+    const __m128i offset = _mm_set1_epi8(33);
+    const __m128i low = _mm_set1_epi32(0xFF);
+    __m128i v, p;
+    unsigned int i;
+
+    /* 4 pixels at a time, a pixel's characters are the bytes of its
+     * little endian word */
+    for(i = 0; i + 4 <= n; i += 4) {
+        v = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(src + (i * 4))), offset);
+        p = _mm_slli_epi32(_mm_and_si128(v, low), 18);
+        p = _mm_or_si128(p, _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(v, 8), low), 12));
+        p = _mm_or_si128(p, _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(v, 16), low), 6));
+        p = _mm_or_si128(p, _mm_srli_epi32(v, 24));
+        _mm_storeu_si128((__m128i *)(dst + i), p);
+    }
+    decode_scalar(dst + i, src + (i * 4), n - i);
+}
+
+__attribute__((target("avx2")))
+void decode_avx2(unsigned int *dst, const char *src, unsigned int n)
+{
+    const __m256i offset = _mm256_set1_epi8(33);
+    const __m256i pairs = _mm256_set1_epi16(0x0140); /* (c0 << 6) + c1 */
+    const __m256i halves = _mm256_set1_epi32(0x00011000); /* (h0 << 12) + h1 */
+    __m256i v;
+    unsigned int i;
+
+    /* 8 pixels at a time, the multiply-adds merge the 6 bit fields
+     * pairwise without any shifting or masking */
+    for(i = 0; i + 8 <= n; i += 8) {
+        v = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i *)(src + (i * 4))), offset);
+        v = _mm256_madd_epi16(_mm256_maddubs_epi16(v, pairs), halves);
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+    }
+    decode_scalar(dst + i, src + (i * 4), n - i);
+}
+#endif
+
+const Decoder *decoders(void)
+{
+    static Decoder list[4];
+    int n = 0;
+
+    if(list[0].name)
+        return list;
+
+#ifdef DECODE_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        list[n++] = (Decoder){ "avx2", decode_avx2 };
+    if(__builtin_cpu_supports("sse2"))
+        list[n++] = (Decoder){ "sse2", decode_sse2 };
+#endif
+    list[n++] = (Decoder){ "scalar", decode_scalar };
+
+    return list;
+}
+
+void decode_pixels(unsigned int *dst, const char *src, unsigned int n)
+{
+    decoders()[0].decode(dst, src, n);
+}
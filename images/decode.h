@@ -0,0 +1,43 @@
+/* decode - Decoders of the GIMP C header pixel encoding
+ *
+ * Copyright 2015 Pontus Andersson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DECODE_H
+#define DECODE_H
+
+/* Decodes n pixels of 4 characters (6 bits each, offset by 33) from src
+ * into 0x00RRGGBB words in dst */
+typedef void (*DecodeKernel)(unsigned int *dst, const char *src, unsigned int n);
+
+typedef struct {
+    const char *name;
+    DecodeKernel decode;
+} Decoder;
+
+void decode_scalar(unsigned int *dst, const char *src, unsigned int n);
+#if defined(__x86_64__) || defined(__i386__)
+#define DECODE_SIMD
+void decode_sse2(unsigned int *dst, const char *src, unsigned int n);
+void decode_avx2(unsigned int *dst, const char *src, unsigned int n);
+#endif
+
+/* The kernels usable on this CPU, fastest first and terminated by an
+ * empty entry */
+const Decoder *decoders(void);
+void decode_pixels(unsigned int *dst, const char *src, unsigned int n);
+
+#endif
@@ -0,0 +1,76 @@
+/* mkimages - Compiles the SecureZone image headers into pixel arrays
+ *
+ * Copyright 2015 Pontus Andersson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Runs on the build host and writes a C header to stdout, holding every
+ * image as 0x00RRGGBB words in a page aligned read-only array. This way
+ * securezone never has to decode the GIMP header encoding at runtime. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "decode.h"
+
+void dump_image(const char *name, unsigned int w, unsigned int h, char *d)
+{
+    unsigned int i, c = w * h;
+    unsigned int *pixels;
+
+    if(!(pixels = malloc(c * sizeof(unsigned int)))) {
+        fprintf(stderr, "mkimages: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    decode_pixels(pixels, d, c);
+
+    printf("#define %s_width %u\n", name, w);
+    printf("#define %s_height %u\n", name, h);
+    printf("static const unsigned int %s_data[%u]\n", name, c);
+    printf("    __attribute__((aligned(4096))) = {");
+    for(i = 0; i < c; i++)
+        printf("%s0x%06x,", i % 8 ? " " : "\n    ", pixels[i]);
+    printf("\n};\n\n");
+
+    free(pixels);
+}
+
+#define XIMAGE_HEADER_BEGIN(name) void dump_##name() {
+#define XIMAGE_HEADER_END(name) dump_image(#name, width, height, header_data); }
+
+XIMAGE_HEADER_BEGIN(message)
+#include "message.h"
+    XIMAGE_HEADER_END(message)
+
+XIMAGE_HEADER_BEGIN(granted)
+#include "access_granted.h"
+    XIMAGE_HEADER_END(granted)
+
+XIMAGE_HEADER_BEGIN(denied)
+#include "access_denied.h"
+    XIMAGE_HEADER_END(denied)
+
+
+int main(void)
+{
+    printf("/* Generated by images/mkimages, do not edit */\n\n");
+    dump_message();
+    dump_granted();
+    dump_denied();
+
+    if(fflush(stdout) || ferror(stdout))
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
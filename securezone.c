@@ -16,161 +16,458 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE /* accept4 */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/Xutil.h>
-#include <X11/extensions/Xinerama.h>
-#include <X11/extensions/dpms.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xrandr.h>
+#include <X11/extensions/scrnsaver.h>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+#include <xcb/dpms.h>
+#include <xcb/randr.h>
+#include <xcb/shm.h>
+#include <xcb/xinerama.h>
 #include <security/pam_appl.h>
 
 #define MAX_INPUTLEN 256
 #define MAX_WILDCARDS 32
+#define FIELD_WEIGHT 3
+#define MAX_SOURCES 8
+#define BLANK_TIMEOUT 60000 /* ms after the last keystroke */
+#define GRAB_TIMEOUT 5000 /* ms to wait for another client's grab */
+#define GRAB_MAX_DELAY 100 /* ms between grab attempts at most */
+#define LATENCY_BUCKETS 24 /* powers of two in us */
+#define WAKE_DEBOUNCE 500000 /* us after blanking before the pointer wakes */
+#define DOTS_VERIFYING -1 /* the inputfield shows the verifying bar */
+#define MAX_WORKERS 16
+#define BENCH_REPAINTS 100
+#define MAX_COMMAND 64
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define INTERSECTS(a, b) ((a).x < (b).x + (b).width && (b).x < (a).x + (a).width \
+        && (a).y < (b).y + (b).height && (b).y < (a).y + (a).height)
+
+enum { ImageMessage, ImageGranted, ImageDenied, ImageLast };
+enum { TraceChar, TraceBackSpace, TraceEscape, TraceReturn, TraceLast };
 
 typedef struct {
     int n;
     Window root, win;
     GC gc;
+    Pixmap images[ImageLast];
+    XRectangle damage; /* exposed area not yet repainted */
+    int damaged;
+} XScreen;
+
+/* What a head shows, the renderer draws the difference between two */
+typedef struct {
+    int message, field; /* drawn or not */
+    int dots; /* wildcards in the inputfield, or DOTS_VERIFYING */
+    int access; /* image in the access banner, -1 for none */
+} Scene;
+
+/* A monitor showing its own message, inputfield and access result, the
+ * geometry is computed once per layout */
+typedef struct {
+    XScreen *screen;
     int x_org, y_org, width, height;
+    XRectangle message;
+    XRectangle field; /* inputfield including the border */
     int ix, iy, iw, ih; /* inputfield */
-} XScreen;
+    int dot_size, dot_y;
+    XRectangle banner; /* access banner, fits every access image */
+    Scene drawn;
+} Head;
+
+/* A connection drawing on the windows, the main one or a worker's */
+typedef struct {
+    Display *dpy;
+    GC *gc; /* one per X screen */
+} Painter;
 
-CARD16 dpms_info, dpms_standby, dpms_suspend, dpms_off;
-BOOL use_dpms;
+/* Renders the heads n % num_workers == index on its own connection, so
+ * the heads of a video wall are drawn in parallel */
+typedef struct {
+    Painter p;
+    pthread_t thread;
+    pthread_mutex_t lock; /* held while rendering */
+    pthread_cond_t cond;
+    Scene want;
+    int pending, quit;
+} Worker;
+
+typedef struct {
+    int fd;
+    int (*handle)(void); /* returns 1 to leave the event loop */
+} Source;
+
+/* Encodes a row of 0x00RRGGBB pixels into an image in server format */
+typedef void (*PixelConverter)(XImage *image, const unsigned int *src, int y);
 
+typedef struct {
+    unsigned long count[LATENCY_BUCKETS];
+    unsigned long n;
+    long long max;
+} Histogram;
+
+unsigned short dpms_standby, dpms_suspend, dpms_off;
+int use_dpms, has_dpms, dpms_pending;
+xcb_dpms_capable_cookie_t dpms_capable_ck;
+xcb_dpms_info_cookie_t dpms_info_ck;
+xcb_dpms_get_timeouts_cookie_t dpms_timeouts_ck;
+
+/* Setup goes through xcb where requests can be sent together and their
+ * replies collected later, events and drawing stay with Xlib */
 Display *dpy;
+xcb_connection_t *xc;
+int has_xinerama;
+xcb_xinerama_is_active_cookie_t xinerama_active_ck;
+xcb_xinerama_query_screens_cookie_t xinerama_screens_ck;
 XScreen *screens;
 int num_screens;
-
-XImage *message, *granted, *denied;
+Head *heads;
+int num_heads;
+int use_randr, randr_event_base;
+int idle_time, saver_event_base; /* s of idle time before locking */
+int saver_timeout, saver_interval, saver_blanking, saver_exposures;
+Painter painter;
+Worker *workers;
+int num_workers, use_workers;
+
+int image_width[ImageLast], image_height[ImageLast];
+PixelConverter pixel_converter; /* NULL when the pixels are server format */
+int pixel_screen; /* screen the images are encoded for */
 unsigned long bgcolor, fgcolor;
+Cursor blank_cursor;
+long long blanked_at;
 char input[MAX_INPUTLEN];
-int inputlen, activated;
+int inputlen, activated, verbose, fixed_slots;
+int input_dirty; /* input changed since the wildcards were drawn */
+int verifying, access_result = -1;
+int use_shm, shm_error, shm_opcode;
+XErrorHandler shm_next_handler;
+pid_t auth_pid;
+int auth_fd = -1; /* result pipe of the running access check */
+int grant_time = 1000; /* ms to show access granted before unlocking */
+int unlocking;
+int start_blank, locked, terminating;
+time_t locked_since;
+long long lock_start; /* lock requested, or main entered */
+long long secure_time, frame_time; /* us from lock_start to grab, to first frame */
+int failed_attempts;
+
+/* Control socket of the daemon and the client waiting for its lock */
+const char *ctl_path;
+int ctl_fd = -1, ctl_client = -1, lock_client = -1;
+
+int epoll_fd = -1, blank_fd = -1, unlock_fd = -1, signal_fd = -1;
+Source sources[MAX_SOURCES];
+sigset_t signal_mask; /* signals handled through signal_fd */
+
+int trace_startup;
+long long trace_main, trace_last; /* main entered, last phase traced */
+unsigned long trace_round_trips, trace_seen;
+int trace_latency, trace_key = -1; /* key waiting for its frame */
+long long trace_start, event_time;
+Histogram flush_latency[TraceLast], sync_latency[TraceLast];
+const char *trace_names[TraceLast] = { "character", "BackSpace", "Escape", "Return" };
 
 void cleanup(void);
 void exit_error(const char *error_str, ...);
+void info(const char *info_str, ...);
+void usage(void);
+long long now_us(void);
+void trace_phase(const char *name_fmt, ...);
+int count_round_trip(Display *d);
+void sync_display(Display *d);
+void *reply_of(unsigned int sequence);
+void query_extensions(void);
+void trace_frame(void);
+void histogram_add(Histogram *h, long long us);
+void dump_histogram(const char *name, const char *stage, Histogram *h);
+void dump_latency(void);
 void event_loop(void);
+void init_event_loop(void);
+int watch_fd(int fd, int (*handle)(void));
+void unwatch_fd(int fd);
+void arm_timer(int fd, long ms);
+int handle_xevents(void);
+int handle_blank_timer(void);
+int handle_unlock_timer(void);
+int handle_signal(void);
 int handle_event(void);
+int handle_ctl_accept(void);
+int handle_ctl_client(void);
+void open_ctl(void);
+void ctl_reply(int fd, const char *fmt, ...);
+void init_idle(void);
+void request_dpms(void);
+void collect_dpms(void);
 void toggle_dpms(void);
+int lock_screens(void);
+int secure_input(void);
+void show_screens(void);
+void unlock_screens(void);
+void prepare_graphics(void);
+void wait_mapped(void);
+int grab_input(void);
+long pointer_events(void);
+XScreen *screen_of(Window w);
+XScreen *stacking_threat(XEvent *ev);
+const char *grab_status(int status);
+Bool is_map_notify(Display *d, XEvent *ev, XPointer arg);
+void request_heads(void);
+Head *collect_heads(int *num);
+void layout_head(Head *h);
+Head *find_head(Head *h, Head *list, int num);
+void relayout(void);
+int same_format(int a, int b);
+void init_pixels(int n);
+void load_images(XImage **image, int n);
+void put_images(XImage **image, int n);
+void free_images(XImage **image);
+void convert_bgr888(XImage *image, const unsigned int *src, int y);
+void convert_rgb565(XImage *image, const unsigned int *src, int y);
+void convert_rgb101010(XImage *image, const unsigned int *src, int y);
+void convert_generic(XImage *image, const unsigned int *src, int y);
+void convert_mono(XImage *image, const unsigned int *src, int y);
+void upload_images(void);
+int shm_upload_images(XImage **image);
+int shm_put_images(XShmSegmentInfo *shminfo, XImage **shmimage, XImage **image, size_t size);
+int shm_error_handler(Display *d, XErrorEvent *e);
 void init_graphics(void);
 void clear_graphics(void);
-void draw_message(int direct);
-void draw_inputfield(int direct);
-void draw_access_blank(int direct);
-void draw_access(XImage *image, int direct);
-void draw_input(int direct);
+void render(void);
+void wanted_scene(Scene *want);
+void render_head(Head *h, Scene *want, Painter *p);
+void paint_message(Head *h, Painter *p);
+void paint_inputfield(Head *h, Painter *p);
+void paint_dots(Head *h, int dots, Painter *p);
+void paint_verifying(Head *h, Painter *p);
+void paint_access(Head *h, int image, Painter *p);
+void start_workers(void);
+void stop_workers(void);
+void *worker_main(void *arg);
+void post_worker(Worker *w, Scene *want);
+void lock_workers(void);
+void unlock_workers(void);
+void sync_render(void);
+void add_damage(XExposeEvent *e);
+void repaint_damage(XScreen *s);
 void update_screens(void);
 int check_input(void);
+int check_result(void);
+int check_done(int access_granted);
+int authenticate(void);
 int pam_check_access(void);
 int pam_input_conv(int n, const struct pam_message **msg, struct pam_response **resp, void *d);
 
-/*int count = 0;*/
-XImage *__load_ximage(int w, int h, char *d)
+#ifdef BENCH
+/* Mean time of repainting every head from scratch */
+void bench_repaint(void)
 {
-    char *p, *image;
-    int c = w * h;
-    image = p = malloc(c * 4 + 1);
-    while(c-- > 0) {
-        p[0] = (((d[2] - 33) & 0x3) << 6) | ((d[3] - 33));
-        p[1] = (((d[1] - 33) & 0xF) << 4) | ((d[2] - 33) >> 2);
-        p[2] = ((d[0] - 33) << 2) | ((d[1] - 33) >> 4);
-        p[3] = 0;
-        d += 4; p += 4;
+    long long start;
+    int i, n;
+
+    start = now_us();
+    for(i = 0; i < BENCH_REPAINTS; i++) {
+        lock_workers();
+        for(n = 0; n < num_heads; n++) {
+            heads[n].drawn.message = heads[n].drawn.field = 0;
+            heads[n].drawn.access = -1;
+        }
+        unlock_workers();
+        render();
+        sync_render();
     }
+    fprintf(stderr, "repaint %d %d %lld\n", num_heads, num_workers,
+            (now_us() - start) / BENCH_REPAINTS);
+}
+#endif
 
-    return XCreateImage (dpy, XDefaultVisual(dpy, DefaultScreen(dpy)),
-            XDefaultDepth(dpy, DefaultScreen(dpy)), ZPixmap, 0, image, w, h, 32, 0);
+static inline int host_byte_order(void)
+{
+    const unsigned int one = 1;
+    return *(const char *)&one ? LSBFirst : MSBFirst;
 }
 
-#define XIMAGE_HEADER_BEGIN(name) XImage * load_ximage_##name () {
-#define XIMAGE_HEADER_END return __load_ximage(width, height, header_data); }
+#include "images/pixels.h"
+
+XImage *__load_ximage(int w, int h, const unsigned int *d)
+{
+    XImage *image;
+    int y;
+
+    image = XCreateImage(dpy, XDefaultVisual(dpy, pixel_screen),
+            XDefaultDepth(dpy, pixel_screen), ZPixmap, 0, NULL, w, h, 32, 0);
+    if(!image)
+        return NULL;
+
+    /* The pixels are pre-packed at build time and shared read-only, when
+     * they are in server format the image only wraps them and must never
+     * free its data */
+    if(!pixel_converter) {
+        image->data = (char *)d;
+        return image;
+    }
+
+    /* Otherwise they are encoded once, uploads are still straight copies */
+    if(!(image->data = malloc(image->bytes_per_line * h))) {
+        free(image);
+        return NULL;
+    }
+    for(y = 0; y < h; y++)
+        pixel_converter(image, d + (y * w), y);
 
-XIMAGE_HEADER_BEGIN(message)
-#include "images/message.h"
-    XIMAGE_HEADER_END
+    return image;
+}
 
-XIMAGE_HEADER_BEGIN(granted)
-#include "images/access_granted.h"
-    XIMAGE_HEADER_END
+#define XIMAGE_LOADER(name) XImage * load_ximage_##name () { \
+    return __load_ximage(name##_width, name##_height, name##_data); }
 
-XIMAGE_HEADER_BEGIN(denied)
-#include "images/access_denied.h"
-    XIMAGE_HEADER_END
+XIMAGE_LOADER(message)
+XIMAGE_LOADER(granted)
+XIMAGE_LOADER(denied)
 
 
 int main(int argc, char **argv)
 {
-    XEvent ev;
     XSetWindowAttributes wa = {0};
-    XineramaScreenInfo *xsi;
-    int n, xsi_num;
+    XGCValues gcv;
+    xcb_alloc_color_cookie_t black_ck, white_ck;
+    xcb_alloc_color_reply_t *color;
+    int n, i;
 
-    XColor black, white;
+    XColor black;
     char empty_data[] = {0, 0, 0, 0, 0, 0, 0, 0};
     Pixmap empty_pm;
-    Cursor cursor;
 
-    if(argc == 2 && strcmp(argv[1], "-v") == 0) {
-        printf("securezone-%s, Copyright 2015 Pontus Andersson\n", VERSION);
-        exit(EXIT_SUCCESS);
+    trace_main = trace_last = lock_start = now_us();
+
+    for(i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-v") == 0) {
+            printf("securezone-%s, Copyright 2015 Pontus Andersson\n", VERSION);
+            exit(EXIT_SUCCESS);
+        } else if(strcmp(argv[i], "-b") == 0) {
+            /* Start blank */
+            start_blank = 1;
+        } else if(strcmp(argv[i], "-V") == 0) {
+            verbose = 1;
+        } else if(strcmp(argv[i], "-T") == 0) {
+            trace_latency = 1;
+        } else if(strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+            grant_time = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "-f") == 0) {
+            /* Wildcards in fixed slots instead of spread over the field */
+            fixed_slots = 1;
+        } else if(strcmp(argv[i], "-w") == 0) {
+            /* Render the heads in parallel on connections of their own */
+            use_workers = 1;
+        } else if(strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            /* Stay resident and lock on commands to this socket */
+            ctl_path = argv[++i];
+        } else if(strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            /* Stay resident and lock after this many seconds of idle */
+            idle_time = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--trace-startup") == 0) {
+            trace_startup = 1;
+        } else {
+            usage();
+        }
     }
 
-    /* Check if to start blank */
-    if(argc == 2 && strcmp(argv[1], "-b") == 0)
-        activated = 0;
-    else
-        activated = 1;
-
     inputlen = 0;
 
+    if(use_workers && !XInitThreads())
+        exit_error("Could not initialize Xlib threads");
     if((dpy = XOpenDisplay(0)) == NULL)
         exit_error("Could not open display");
-
-    if(DPMSCapable(dpy)) {
-        DPMSInfo(dpy, &dpms_info, &use_dpms);
-        if(use_dpms)
-            DPMSGetTimeouts(dpy, &dpms_standby, &dpms_suspend, &dpms_off);
-    } else {
-        use_dpms = False;
+    if(trace_startup) {
+        /* Every request of the connection setup waits for its reply,
+         * later ones are counted as they complete */
+        trace_round_trips = NextRequest(dpy);
+        trace_seen = LastKnownRequestProcessed(dpy);
+        XSetAfterFunction(dpy, count_round_trip);
     }
+    trace_phase("open");
+
+    /* The extension queries go out now and are answered with the grab */
+    xc = XGetXCBConnection(dpy);
+    xcb_prefetch_extension_data(xc, &xcb_randr_id);
+    xcb_prefetch_extension_data(xc, &xcb_dpms_id);
+    xcb_prefetch_extension_data(xc, &xcb_xinerama_id);
+    xcb_prefetch_extension_data(xc, &xcb_shm_id);
 
     black.red = 0x0;    black.green = 0;      black.blue = 0;
-    white.red = 0xFFFF; white.green = 0xFFFF; white.blue = 0xFFFF;
-    XAllocColor(dpy, DefaultColormap(dpy, DefaultScreen(dpy)), &black);
-    XAllocColor(dpy, DefaultColormap(dpy, DefaultScreen(dpy)), &white);
-    bgcolor = black.pixel;
-    fgcolor = white.pixel;
 
+    /* Hide cursor, no round trip so it is ready for the grab */
+    empty_pm = XCreateBitmapFromData(dpy, DefaultRootWindow(dpy), empty_data, 8, 8);
+    blank_cursor = XCreatePixmapCursor(dpy, empty_pm, empty_pm, &black, &black, 0, 0);
+    XFreePixmap(dpy, empty_pm);
+
+    /* Grabs only need the roots, so input is secured before anything
+     * else is set up. Keys typed from now on queue up for the input */
+    if(!ctl_path && idle_time <= 0 && secure_input())
+        exit_error("Could not grab input");
+    query_extensions();
+
+    /* Everything else the setup asks the server is sent at once, so it
+     * costs a single round trip however many screens there are */
+    black_ck = xcb_alloc_color(xc, DefaultColormap(dpy, DefaultScreen(dpy)), 0, 0, 0);
+    white_ck = xcb_alloc_color(xc, DefaultColormap(dpy, DefaultScreen(dpy)),
+            0xFFFF, 0xFFFF, 0xFFFF);
+    if(locked)
+        request_dpms();
+    request_heads();
+
+    if(!(color = reply_of(black_ck.sequence)))
+        exit_error("Could not allocate black");
+    bgcolor = color->pixel;
+    free(color);
+    if(!(color = reply_of(white_ck.sequence)))
+        exit_error("Could not allocate white");
+    fgcolor = color->pixel;
+    free(color);
+    trace_phase("colors");
+
+    /* Windows are created once, a daemon maps them for every lock */
     num_screens = ScreenCount(dpy);
-    screens = malloc(sizeof(Screen) * num_screens);
+    screens = malloc(sizeof(XScreen) * num_screens);
+    painter.dpy = dpy;
+    painter.gc = malloc(sizeof(GC) * num_screens);
     for(n = 0; n < num_screens; n++) {
-        screens[n].n = 0;
+        screens[n].n = n;
         screens[n].root = RootWindow(dpy, n);
-        screens[n].width = 0;
-
-        if(XineramaIsActive(dpy)) {
-            xsi = (XineramaScreenInfo *) XineramaQueryScreens(dpy, &xsi_num);
-            if(xsi_num > 0) {
-                screens[n].x_org = xsi[0].x_org;
-                screens[n].y_org = xsi[0].y_org;
-                screens[n].width = xsi[0].width;
-                screens[n].height = xsi[0].height;
-            }
-            free(xsi);
-        }
-
-        if(!screens[n].width) {
-            screens[n].x_org = 0;
-            screens[n].y_org = 0;
-            screens[n].width = DisplayWidth(dpy, n);
-            screens[n].height = DisplayHeight(dpy, n);
-        }
-
-        screens[n].gc = XCreateGC(dpy, screens[n].root, 0, NULL);
+        screens[n].damaged = 0;
+
+        /* No GraphicsExpose/NoExpose events for the pixmap copies */
+        gcv.graphics_exposures = False;
+        screens[n].gc = XCreateGC(dpy, screens[n].root, GCGraphicsExposures, &gcv);
+        painter.gc[n] = screens[n].gc;
+        for(i = 0; i < ImageLast; i++)
+            screens[n].images[i] = None;
         wa.override_redirect = 1;
         wa.background_pixel = bgcolor;
         screens[n].win = XCreateWindow(dpy, screens[n].root, 0, 0,
@@ -178,35 +475,45 @@ int main(int argc, char **argv)
                 DefaultDepth(dpy, n), CopyFromParent,
                 DefaultVisual(dpy, n), CWOverrideRedirect | CWBackPixel, &wa);
 
-        /* Hide cursor */
-        empty_pm = XCreateBitmapFromData(dpy, screens[n].win, empty_data, 8, 8);
-        cursor = XCreatePixmapCursor(dpy, empty_pm, empty_pm, &black, &black, 0, 0);
-        XSelectInput(dpy, screens[n].win, ExposureMask);
+        XSelectInput(dpy, screens[n].win, ExposureMask | VisibilityChangeMask);
         XSelectInput(dpy, screens[n].root, SubstructureNotifyMask);
-        XDefineCursor(dpy, screens[n].win, cursor);
-
-        /* Map window and wait for the event */
-        XMapWindow(dpy, screens[n].win);
-        for(; ev.type != MapNotify; XNextEvent(dpy, &ev));
-
-        /* Grab keyboard and mouse */
-        while(XGrabKeyboard(dpy, screens[n].root, True, GrabModeAsync, GrabModeAsync, CurrentTime) != GrabSuccess)
-            usleep(1000);
-        while(XGrabPointer(dpy, screens[n].root, False, ButtonPressMask | ButtonReleaseMask | PointerMotionMask,
-                    GrabModeAsync, GrabModeAsync, None, cursor, CurrentTime) != GrabSuccess)
-            usleep(1000);
+        /* Follow monitors being added, removed or moved while locked */
+        if(use_randr)
+            XRRSelectInput(dpy, screens[n].root, RRScreenChangeNotifyMask);
+        XDefineCursor(dpy, screens[n].win, blank_cursor);
+        trace_phase("window-%d", n);
+    }
 
-        XFreeCursor(dpy, cursor);
+    init_event_loop();
+
+    if(ctl_path || idle_time > 0) {
+        /* Everything but the lock itself is done while warm, and the
+         * daemon returns to this state after every unlock */
+        if(ctl_path)
+            open_ctl();
+        if(idle_time > 0)
+            init_idle();
+        prepare_graphics();
+        while(!terminating) {
+            event_loop();
+            lock_start = now_us();
+            if(!terminating && lock_screens() == 0)
+                event_loop();
+            if(locked)
+                unlock_screens();
+        }
+        cleanup();
+        return EXIT_SUCCESS;
     }
 
-    message = load_ximage_message();
-    granted = load_ximage_granted();
-    denied = load_ximage_denied();
+    show_screens();
 
-    if(activated)
-        init_graphics();
-    else
-        toggle_dpms();
+#ifdef BENCH
+    /* Only the startup is measured, show_screens synced the first frame */
+    bench_repaint();
+    cleanup();
+    return EXIT_SUCCESS;
+#endif
 
     event_loop();
 
@@ -217,26 +524,48 @@ int main(int argc, char **argv)
 
 void cleanup()
 {
-    int n;
+    int n, i;
+
+    if(trace_latency)
+        dump_latency();
+
+    stop_workers();
 
     inputlen = MAX_INPUTLEN;
     while(inputlen-- > 0)
         input[inputlen] = '\0';
 
+    /* Give the desktop back first, the rest is only freeing resources */
+    if(locked)
+        unlock_screens();
+
+    if(saver_event_base)
+        XSetScreenSaver(dpy, saver_timeout, saver_interval, saver_blanking,
+                saver_exposures);
+
+    if(ctl_fd >= 0) {
+        close(ctl_fd);
+        unlink(ctl_path);
+    }
+    if(ctl_client >= 0)
+        close(ctl_client);
+    if(lock_client >= 0)
+        close(lock_client);
+
     for(n = 0; n < num_screens; n++) {
+        for(i = 0; i < ImageLast; i++)
+            if(screens[n].images[i] != None)
+                XFreePixmap(dpy, screens[n].images[i]);
         XDestroyWindow(dpy, screens[n].win);
         XFreeGC(dpy, screens[n].gc);
     }
 
-    XUngrabPointer(dpy, CurrentTime);
-
     free(screens);
-    free(message);
-    free(granted);
-    free(denied);
+    free(heads);
+    free(painter.gc);
 
-    if(use_dpms)
-        DPMSSetTimeouts(dpy, dpms_standby, dpms_suspend, dpms_off);
+    if(blank_cursor)
+        XFreeCursor(dpy, blank_cursor);
 
     XCloseDisplay(dpy);
 }
@@ -252,43 +581,336 @@ void exit_error(const char *error_str, ...)
     exit(EXIT_FAILURE);
 }
 
-void event_loop()
+void info(const char *info_str, ...)
 {
-    int x11_fd;
-    fd_set in_fds;
-    struct timeval tv;
+    va_list ap;
+    if(!verbose)
+        return;
+    va_start(ap, info_str);
+    fprintf(stderr, "INFO: ");
+    vfprintf(stderr, info_str, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+}
+
+long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000);
+}
 
-    x11_fd = ConnectionNumber(dpy);
+/* Prints the us since main, the us and the round trips since the last
+ * phase, read by bench/startup.sh */
+void trace_phase(const char *name_fmt, ...)
+{
+    char name[32];
+    long long now;
+    va_list ap;
+
+    if(!trace_startup)
+        return;
+    va_start(ap, name_fmt);
+    vsnprintf(name, sizeof name, name_fmt, ap);
+    va_end(ap);
+
+    now = now_us();
+    fprintf(stderr, "phase %s %lld %lld %lu\n", name, now - trace_main,
+            now - trace_last, trace_round_trips);
+    trace_last = now;
+    trace_round_trips = 0;
+}
+
+void *reply_of(unsigned int sequence)
+{
+    xcb_generic_error_t *e = NULL;
+    void *reply = NULL;
+
+    /* Only a reply that is not in yet costs a round trip. An error is
+     * returned as no reply */
+    if(!xcb_poll_for_reply(xc, sequence, &reply, &e)) {
+        trace_round_trips++;
+        reply = xcb_wait_for_reply(xc, sequence, &e);
+    }
+    if(e) {
+        free(e);
+        free(reply);
+        return NULL;
+    }
+    return reply;
+}
+
+void query_extensions(void)
+{
+    const xcb_query_extension_reply_t *ext;
+    int error_base;
+
+    /* Prefetched right after connecting. Xrandr still has to be set up
+     * on the Xlib side, or Xlib has no converter for its events and
+     * drops them before they reach the event loop */
+    if((ext = xcb_get_extension_data(xc, &xcb_randr_id)) && ext->present)
+        use_randr = XRRQueryExtension(dpy, &randr_event_base, &error_base);
+    has_dpms = (ext = xcb_get_extension_data(xc, &xcb_dpms_id)) && ext->present;
+    has_xinerama = (ext = xcb_get_extension_data(xc, &xcb_xinerama_id)) && ext->present;
+    if((ext = xcb_get_extension_data(xc, &xcb_shm_id)) && ext->present)
+        shm_opcode = ext->major_opcode;
+}
+
+int count_round_trip(Display *d)
+{
+    /* Called after every request, one that has been answered up to
+     * itself waited for its reply */
+    if(LastKnownRequestProcessed(d) == NextRequest(d) - 1
+            && LastKnownRequestProcessed(d) != trace_seen)
+        trace_round_trips++;
+    trace_seen = LastKnownRequestProcessed(d);
+    return 0;
+}
+
+void sync_display(Display *d)
+{
+    /* XSync waits without going through the after function, so its
+     * round trip is counted here */
+    XSync(d, False);
+    trace_round_trips++;
+}
+
+void trace_frame(void)
+{
+    /* Flushed is when the requests left, synced when the server has
+     * executed them, including what the workers render */
+    histogram_add(&flush_latency[trace_key], now_us() - trace_start);
+    sync_render();
+    histogram_add(&sync_latency[trace_key], now_us() - trace_start);
+    trace_key = -1;
+}
+
+void histogram_add(Histogram *h, long long us)
+{
+    int i;
+
+    for(i = 0; i < LATENCY_BUCKETS - 1 && us >= (2LL << i); i++);
+    h->count[i]++;
+    h->n++;
+    h->max = MAX(h->max, us);
+}
+
+void dump_histogram(const char *name, const char *stage, Histogram *h)
+{
+    unsigned long seen = 0;
+    long long p50 = 0, p99 = 0;
+    int i;
+
+    if(!h->n)
+        return;
+
+    for(i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += h->count[i];
+        if(!p50 && seen * 2 >= h->n)
+            p50 = 2LL << i;
+        if(!p99 && seen * 100 >= h->n * 99)
+            p99 = 2LL << i;
+    }
+
+    fprintf(stderr, "latency %s %s: %lu keys, p50 < %lld us, p99 < %lld us, max %lld us\n",
+            name, stage, h->n, p50, p99, h->max);
+    for(i = 0; i < LATENCY_BUCKETS; i++)
+        if(h->count[i])
+            fprintf(stderr, "  < %8lld us: %lu\n", 2LL << i, h->count[i]);
+}
+
+void dump_latency(void)
+{
+    int i;
+
+    fprintf(stderr, "lock: input secure after %lld us, first frame after %lld us\n",
+            secure_time, frame_time);
+    for(i = 0; i < TraceLast; i++) {
+        dump_histogram(trace_names[i], "flushed", &flush_latency[i]);
+        dump_histogram(trace_names[i], "synced", &sync_latency[i]);
+    }
+}
+
+void usage(void)
+{
+    fprintf(stderr, "usage: securezone [-v] [-b] [-f] [-g ms] [-T] [-V] [-w] [-d socket]"
+            " [-i seconds] [--trace-startup]\n");
+    exit(EXIT_FAILURE);
+}
+
+void event_loop()
+{
+    struct epoll_event ev[MAX_SOURCES];
+    int n, i;
 
     while(1) {
-        FD_ZERO(&in_fds);
-        FD_SET(x11_fd, &in_fds);
-        tv.tv_usec = 0;
-        tv.tv_sec = 60;
+        /* Round trips elsewhere may have queued events without the
+         * connection being readable, so drain the queue before waiting */
+        if(handle_xevents())
+            return;
 
-        if(!select(x11_fd+1, &in_fds, 0, 0, &tv) && activated)
-            clear_graphics();
+        if((n = epoll_wait(epoll_fd, ev, MAX_SOURCES, -1)) < 0 && errno != EINTR)
+            exit_error("Could not wait for events");
 
-        while(XPending(dpy))
-            if(handle_event())
+        for(i = 0; i < n; i++)
+            if(sources[ev[i].data.u32].fd >= 0 && sources[ev[i].data.u32].handle())
                 return;
     }
 }
 
+void init_event_loop(void)
+{
+    int i;
+
+    for(i = 0; i < MAX_SOURCES; i++)
+        sources[i].fd = -1;
+
+    sigemptyset(&signal_mask);
+    sigaddset(&signal_mask, SIGTERM);
+    sigaddset(&signal_mask, SIGUSR1);
+    sigaddset(&signal_mask, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &signal_mask, NULL);
+
+    if((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0
+            || (signal_fd = signalfd(-1, &signal_mask, SFD_CLOEXEC)) < 0
+            || (blank_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0
+            || (unlock_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0)
+        exit_error("Could not set up the event loop");
+
+    if(watch_fd(ConnectionNumber(dpy), handle_xevents)
+            || watch_fd(signal_fd, handle_signal)
+            || watch_fd(blank_fd, handle_blank_timer)
+            || watch_fd(unlock_fd, handle_unlock_timer))
+        exit_error("Could not watch the event sources");
+}
+
+int watch_fd(int fd, int (*handle)(void))
+{
+    struct epoll_event ev = {0};
+    int i;
+
+    for(i = 0; i < MAX_SOURCES && sources[i].fd >= 0; i++);
+    if(i == MAX_SOURCES)
+        return -1;
+
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        return -1;
+
+    sources[i].fd = fd;
+    sources[i].handle = handle;
+    return 0;
+}
+
+void unwatch_fd(int fd)
+{
+    int i;
+
+    for(i = 0; i < MAX_SOURCES; i++) {
+        if(sources[i].fd == fd) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            sources[i].fd = -1;
+        }
+    }
+}
+
+void arm_timer(int fd, long ms)
+{
+    struct itimerspec its = {{0}};
+
+    /* A zero time disarms the timer */
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000;
+    timerfd_settime(fd, 0, &its, NULL);
+}
+
+int handle_xevents(void)
+{
+    while(XPending(dpy))
+        if(handle_event())
+            return 1;
+
+    /* All queued keys are in, draw them with one render pass */
+    if(input_dirty) {
+        input_dirty = 0;
+        render();
+    }
+
+    /* Keys that did not draw anything are not traced */
+    trace_key = -1;
+    return 0;
+}
+
+int handle_blank_timer(void)
+{
+    unsigned long long expirations;
+
+    read(blank_fd, &expirations, sizeof expirations);
+    if(activated && !unlocking)
+        clear_graphics();
+    return 0;
+}
+
+int handle_unlock_timer(void)
+{
+    unsigned long long expirations;
+
+    read(unlock_fd, &expirations, sizeof expirations);
+    return 1;
+}
+
+int handle_signal(void)
+{
+    struct signalfd_siginfo si;
+
+    if(read(signal_fd, &si, sizeof si) != sizeof si)
+        return 0;
+
+    switch(si.ssi_signo) {
+        case SIGTERM:
+            terminating = 1;
+            return 1;
+        case SIGUSR1:
+            /* A warm daemon locks, a locked screen blanks right away */
+            if(!locked)
+                return 1;
+            if(activated && !unlocking) {
+                inputlen = 0;
+                clear_graphics();
+            }
+            break;
+        case SIGUSR2:
+            if(trace_latency)
+                dump_latency();
+            break;
+    }
+    return 0;
+}
+
 int handle_event(void)
 {
     XEvent ev;
+    XScreen *sc;
     KeySym key;
     char s[32];
     int n;
 
     XNextEvent(dpy, &ev);
+    if(trace_latency)
+        event_time = now_us();
 
     if(ev.type == KeyPress) {
+        arm_timer(blank_fd, BLANK_TIMEOUT);
         if(!activated) {
             init_graphics();
             return 0;;
         }
+        /* Keystrokes are rejected while an access check is running so
+         * they never end up in the next attempt, or after access is
+         * granted */
+        if(auth_fd >= 0 || unlocking)
+            return 0;
         n = XLookupString(&ev.xkey, s, sizeof s, &key, 0);
         if(IsKeypadKey(key)) {
             if(key == XK_KP_Enter)
@@ -301,11 +923,16 @@ int handle_event(void)
                 || IsPrivateKeypadKey(key)) {
             return 0;
         }
+        /* A batch of keys is traced from its first key, Return is drawn
+         * right away and traced on its own */
+        if(trace_latency && (trace_key < 0 || key == XK_Return)) {
+            trace_start = event_time;
+            trace_key = key == XK_Return ? TraceReturn : key == XK_Escape ? TraceEscape
+                : key == XK_BackSpace ? TraceBackSpace : TraceChar;
+        }
         switch(key) {
             case XK_Return:
-                if(check_input())
-                    return 1;
-                break;
+                return check_input();
             case XK_Escape:
                 if(inputlen == 0)
                     clear_graphics();
@@ -322,173 +949,1346 @@ int handle_event(void)
                 }
                 break;
         }
-        if(activated)
-            draw_input(1);
+        input_dirty = 1;
     } else if(ev.type == Expose && activated) {
+        add_damage(&ev.xexpose);
+    } else if(ev.type == MotionNotify || ev.type == ButtonPress) {
+        /* Coalesce the motion, any amount of it is one wake up */
+        while(XCheckTypedEvent(dpy, MotionNotify, &ev));
+        if(!activated && now_us() - blanked_at >= WAKE_DEBOUNCE) {
+            arm_timer(blank_fd, BLANK_TIMEOUT);
+            init_graphics();
+        }
+    } else if(saver_event_base && ev.type == saver_event_base + ScreenSaverNotify) {
+        /* The server saw no input for idle_time, lock a warm daemon */
+        if(!locked && ((XScreenSaverNotifyEvent *)&ev)->state == ScreenSaverOn)
+            return 1;
+    } else if(use_randr && ev.type == randr_event_base + RRScreenChangeNotify) {
+        XRRUpdateConfiguration(&ev);
+        relayout();
+    } else if(locked && (sc = stacking_threat(&ev))) {
+        XRaiseWindow(dpy, sc->win);
+    }
+
+    return 0;
+}
+
+Bool is_map_notify(Display *d, XEvent *ev, XPointer arg)
+{
+    int n;
+
+    if(ev->type != MapNotify)
+        return False;
+    for(n = 0; n < num_screens; n++)
+        if(ev->xmap.window == screens[n].win)
+            return True;
+    return False;
+}
+
+int handle_ctl_accept(void)
+{
+    int fd;
+
+    /* Like every other descriptor, kept out of the PAM child */
+    if((fd = accept4(ctl_fd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+        return 0;
+
+    /* One client at a time, a newer one replaces a stalled one */
+    if(ctl_client >= 0) {
+        unwatch_fd(ctl_client);
+        close(ctl_client);
+    }
+    ctl_client = fd;
+    if(watch_fd(ctl_client, handle_ctl_client)) {
+        close(ctl_client);
+        ctl_client = -1;
+    }
+    return 0;
+}
+
+int handle_ctl_client(void)
+{
+    char cmd[MAX_COMMAND];
+    int fd = ctl_client;
+    ssize_t len;
+
+    unwatch_fd(ctl_client);
+    ctl_client = -1;
+
+    if((len = read(fd, cmd, sizeof cmd - 1)) <= 0) {
+        close(fd);
+        return 0;
+    }
+    cmd[len] = '\0';
+    cmd[strcspn(cmd, "\r\n")] = '\0';
+
+    if(strcmp(cmd, "lock") == 0) {
+        if(locked) {
+            ctl_reply(fd, "ok\n");
+            return 0;
+        }
+        /* Answered once the screens are locked, in lock_screens */
+        if(lock_client >= 0)
+            close(lock_client);
+        lock_client = fd;
+        return 1;
+    } else if(strcmp(cmd, "status") == 0) {
+        ctl_reply(fd, "locked %d\nsince %ld\nfailed %d\nsecure_us %lld\nframe_us %lld\n",
+                locked, locked ? (long)locked_since : 0L, failed_attempts,
+                secure_time, frame_time);
+    } else {
+        ctl_reply(fd, "error unknown command\n");
+    }
+    return 0;
+}
+
+void open_ctl(void)
+{
+    struct sockaddr_un addr = {0};
+    struct stat st;
+    mode_t mask;
+    int fd, bound;
+
+    if(strlen(ctl_path) >= sizeof addr.sun_path)
+        exit_error("Socket path too long: %s", ctl_path);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, ctl_path);
+
+    /* Only a stale socket is replaced, never another file or the socket
+     * of a daemon still running */
+    if(lstat(ctl_path, &st) == 0) {
+        if(!S_ISSOCK(st.st_mode))
+            exit_error("Not a socket: %s", ctl_path);
+        if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+            exit_error("Could not create socket");
+        if(connect(fd, (struct sockaddr *)&addr, sizeof addr) == 0)
+            exit_error("Already listening on %s", ctl_path);
+        close(fd);
+        unlink(ctl_path);
+    }
+
+    if((ctl_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        exit_error("Could not create socket");
+
+    /* The socket locks the session, only its owner may connect. The
+     * mask is restored so the PAM child does not inherit it */
+    mask = umask(077);
+    bound = bind(ctl_fd, (struct sockaddr *)&addr, sizeof addr);
+    umask(mask);
+    if(bound < 0) {
+        /* Cleanup must not unlink a path that is not ours */
+        close(ctl_fd);
+        ctl_fd = -1;
+        exit_error("Could not bind %s", ctl_path);
+    }
+    if(listen(ctl_fd, 4) < 0 || watch_fd(ctl_fd, handle_ctl_accept))
+        exit_error("Could not listen on %s", ctl_path);
+    info("Listening on %s", ctl_path);
+}
+
+void ctl_reply(int fd, const char *fmt, ...)
+{
+    char buf[256];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof buf, fmt, ap);
+    va_end(ap);
+
+    /* A client that went away must not take the locker down with SIGPIPE */
+    send(fd, buf, MIN(len, sizeof buf - 1), MSG_NOSIGNAL);
+    close(fd);
+}
+
+void init_idle(void)
+{
+    int n, err;
+
+    if(!XScreenSaverQueryExtension(dpy, &saver_event_base, &err))
+        exit_error("MIT-SCREEN-SAVER extension missing, needed by -i");
+
+    /* The server times the idle period and notifies when it is over,
+     * its saver settings are given back on exit */
+    XGetScreenSaver(dpy, &saver_timeout, &saver_interval, &saver_blanking,
+            &saver_exposures);
+    XSetScreenSaver(dpy, idle_time, saver_interval, saver_blanking, saver_exposures);
+    for(n = 0; n < num_screens; n++)
+        XScreenSaverSelectInput(dpy, screens[n].root, ScreenSaverNotifyMask);
+    info("Locking after %d s of idle time", idle_time);
+}
+
+void request_dpms(void)
+{
+    /* Queried on every lock, the user may change them in between */
+    if(!has_dpms || dpms_pending)
+        return;
+    dpms_capable_ck = xcb_dpms_capable(xc);
+    dpms_info_ck = xcb_dpms_info(xc);
+    dpms_timeouts_ck = xcb_dpms_get_timeouts(xc);
+    dpms_pending = 1;
+}
+
+void collect_dpms(void)
+{
+    xcb_dpms_capable_reply_t *capable;
+    xcb_dpms_info_reply_t *info;
+    xcb_dpms_get_timeouts_reply_t *timeouts;
+
+    use_dpms = 0;
+    if(!dpms_pending)
+        return;
+    dpms_pending = 0;
+
+    capable = reply_of(dpms_capable_ck.sequence);
+    info = reply_of(dpms_info_ck.sequence);
+    timeouts = reply_of(dpms_timeouts_ck.sequence);
+    if(capable && capable->capable && info && info->state && timeouts) {
+        use_dpms = 1;
+        dpms_standby = timeouts->standby_timeout;
+        dpms_suspend = timeouts->suspend_timeout;
+        dpms_off = timeouts->off_timeout;
+    }
+    free(capable);
+    free(info);
+    free(timeouts);
+}
+
+int lock_screens(void)
+{
+    if(secure_input()) {
+        if(lock_client >= 0)
+            ctl_reply(lock_client, "error could not grab input\n");
+        lock_client = -1;
+        return -1;
+    }
+
+    show_screens();
+    return 0;
+}
+
+int secure_input(void)
+{
+    activated = !start_blank;
+    if(grab_input()) {
+        activated = 0;
+        return -1;
+    }
+
+    locked = 1;
+    locked_since = time(NULL);
+    failed_attempts = 0;
+    secure_time = now_us() - lock_start;
+    return 0;
+}
+
+void show_screens(void)
+{
+    int n;
+
+    request_dpms();
+    collect_dpms();
+    trace_phase("dpms");
+
+    /* Raised, the windows may be older than anything on the screens.
+     * Keys typed meanwhile stay queued for the event loop */
+    for(n = 0; n < num_screens; n++)
+        XMapRaised(dpy, screens[n].win);
+    wait_mapped();
+    trace_phase("mapped");
+
+    /* Answered once the screens are covered, so a client may suspend
+     * right away. Painting follows */
+    if(lock_client >= 0)
+        ctl_reply(lock_client, "ok\n");
+    lock_client = -1;
+
+    if(!heads)
+        prepare_graphics();
+
+    if(activated) {
+        arm_timer(blank_fd, BLANK_TIMEOUT);
         init_graphics();
     } else {
-        for(n = 0; n < num_screens; n++)
-            XRaiseWindow(dpy, screens[n].win);
+        blanked_at = now_us();
+        toggle_dpms();
     }
 
+    sync_render();
+    frame_time = now_us() - lock_start;
+    trace_phase("frame");
+    info("Input secure after %lld us, first frame after %lld us",
+            secure_time, frame_time);
+}
+
+void unlock_screens(void)
+{
+    int n;
+
+    arm_timer(blank_fd, 0);
+    arm_timer(unlock_fd, 0);
+    if(auth_fd >= 0) {
+        /* A check still running only belongs to this lock */
+        unwatch_fd(auth_fd);
+        close(auth_fd);
+        auth_fd = -1;
+        kill(auth_pid, SIGKILL);
+        waitpid(auth_pid, NULL, 0);
+    }
+    while(inputlen)
+        input[--inputlen] = '\0';
+
+    for(n = 0; n < num_screens; n++)
+        XUnmapWindow(dpy, screens[n].win);
+    XUngrabKeyboard(dpy, CurrentTime);
+    XUngrabPointer(dpy, CurrentTime);
+    if(use_dpms)
+        xcb_dpms_set_timeouts(xc, dpms_standby, dpms_suspend, dpms_off);
+    XFlush(dpy);
+    xcb_flush(xc);
+
+    /* The unmapped windows lost their contents, start from nothing */
+    sync_render();
+    lock_workers();
+    for(n = 0; n < num_heads; n++)
+        layout_head(&heads[n]);
+    unlock_workers();
+
+    activated = locked = unlocking = 0;
+    verifying = 0;
+    access_result = -1;
+}
+
+void prepare_graphics(void)
+{
+    upload_images();
+    heads = collect_heads(&num_heads);
+    if(use_workers)
+        start_workers();
+    trace_phase("heads");
+}
+
+void wait_mapped(void)
+{
+    XEvent ev;
+    int mapped = 0;
+
+    /* Leaves every other event, like the first exposes, in the queue */
+    while(mapped < num_screens) {
+        XIfEvent(dpy, &ev, is_map_notify, NULL);
+        mapped++;
+    }
+}
+
+int grab_input(void)
+{
+    xcb_grab_keyboard_cookie_t kbd_ck = {0};
+    xcb_grab_pointer_cookie_t ptr_ck = {0};
+    xcb_grab_keyboard_reply_t *kbd_reply;
+    xcb_grab_pointer_reply_t *ptr_reply;
+    int kbd = -1, ptr = -1;
+    long waited = 0, delay = 1;
+
+    /* A grab is refused while another client holds one, so retry with
+     * backoff for a while and give up instead of hanging unlocked. Both
+     * grabs are sent before waiting, an attempt is one round trip */
+    while(1) {
+        if(kbd != GrabSuccess)
+            kbd_ck = xcb_grab_keyboard(xc, 1, RootWindow(dpy, 0), XCB_CURRENT_TIME,
+                    XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+        if(ptr != GrabSuccess)
+            ptr_ck = xcb_grab_pointer(xc, 0, RootWindow(dpy, 0), pointer_events(),
+                    XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC, XCB_NONE, blank_cursor,
+                    XCB_CURRENT_TIME);
+
+        if(kbd != GrabSuccess) {
+            kbd_reply = reply_of(kbd_ck.sequence);
+            kbd = kbd_reply ? kbd_reply->status : -1;
+            free(kbd_reply);
+            if(kbd == GrabSuccess)
+                trace_phase("grab-keyboard");
+        }
+        if(ptr != GrabSuccess) {
+            ptr_reply = reply_of(ptr_ck.sequence);
+            ptr = ptr_reply ? ptr_reply->status : -1;
+            free(ptr_reply);
+            if(ptr == GrabSuccess)
+                trace_phase("grab-pointer");
+        }
+        if(kbd == GrabSuccess && ptr == GrabSuccess)
+            break;
+
+        if(waited >= GRAB_TIMEOUT) {
+            if(kbd != GrabSuccess)
+                fprintf(stderr, "ERROR: Could not grab keyboard: %s\n", grab_status(kbd));
+            else
+                fprintf(stderr, "ERROR: Could not grab pointer: %s\n", grab_status(ptr));
+            XUngrabKeyboard(dpy, CurrentTime);
+            XUngrabPointer(dpy, CurrentTime);
+            return -1;
+        }
+
+        usleep(delay * 1000);
+        waited += delay;
+        delay = MIN(delay * 2, GRAB_MAX_DELAY);
+    }
+
+    if(waited)
+        info("Input grabbed after %ld ms of retries", waited);
     return 0;
 }
 
+long pointer_events(void)
+{
+    /* Pointer motion is only of interest to wake up a blank screen */
+    return activated ? ButtonPressMask : ButtonPressMask | PointerMotionMask;
+}
+
+const char *grab_status(int status)
+{
+    switch(status) {
+        case AlreadyGrabbed:
+            return "held by another client";
+        case GrabFrozen:
+            return "frozen by another client";
+        case GrabNotViewable:
+            return "window not viewable";
+        case GrabInvalidTime:
+            return "invalid time";
+    }
+    return "unknown error";
+}
+
+XScreen *screen_of(Window w)
+{
+    int n;
+
+    for(n = 0; n < num_screens; n++)
+        if(screens[n].win == w || screens[n].root == w)
+            return &screens[n];
+    return NULL;
+}
+
+XScreen *stacking_threat(XEvent *ev)
+{
+    XScreen *s;
+
+    /* Only a window that may end up above ours is a reason to raise,
+     * everything else on the root is left alone */
+    switch(ev->type) {
+        case VisibilityNotify:
+            if(ev->xvisibility.state != VisibilityUnobscured)
+                return screen_of(ev->xvisibility.window);
+            break;
+        case MapNotify:
+            if(!(s = screen_of(ev->xmap.window)))
+                return screen_of(ev->xmap.event);
+            break;
+        case ConfigureNotify:
+            if((s = screen_of(ev->xconfigure.event)) && ev->xconfigure.window != s->win
+                    && ev->xconfigure.above == s->win)
+                return s;
+            break;
+        case CirculateNotify:
+            if((s = screen_of(ev->xcirculate.event)) && ev->xcirculate.window != s->win
+                    && ev->xcirculate.place == PlaceOnTop)
+                return s;
+            break;
+    }
+    return NULL;
+}
+
 void toggle_dpms(void)
 {
     if(use_dpms) {
         if(activated)
-            DPMSSetTimeouts(dpy, 0, 0, 0);
+            xcb_dpms_set_timeouts(xc, 0, 0, 0);
         else
-            DPMSSetTimeouts(dpy, 30, 300, 600);
+            xcb_dpms_set_timeouts(xc, 30, 300, 600);
+    }
+}
+
+void request_heads(void)
+{
+    if(!has_xinerama)
+        return;
+    xinerama_active_ck = xcb_xinerama_is_active(xc);
+    xinerama_screens_ck = xcb_xinerama_query_screens(xc);
+}
+
+Head *collect_heads(int *num)
+{
+    xcb_xinerama_is_active_reply_t *active = NULL;
+    xcb_xinerama_query_screens_reply_t *reply = NULL;
+    xcb_xinerama_screen_info_t *xsi = NULL;
+    Head *list;
+    int i, xsi_num = 0;
+
+    /* Xinerama lists every monitor of the one big screen, without it
+     * each X screen is a head of its own. The queries were sent by
+     * request_heads */
+    if(has_xinerama) {
+        active = reply_of(xinerama_active_ck.sequence);
+        reply = reply_of(xinerama_screens_ck.sequence);
+        if(active && active->state && reply) {
+            xsi = xcb_xinerama_query_screens_screen_info(reply);
+            xsi_num = xcb_xinerama_query_screens_screen_info_length(reply);
+        }
     }
+
+    /* A new table, so a relayout can build it before the workers are
+     * stopped and never exits while holding them */
+    *num = xsi_num > 0 ? xsi_num : num_screens;
+    list = calloc(*num, sizeof(Head));
+    if(!list)
+        exit_error("Could not allocate heads");
+
+    for(i = 0; i < *num; i++) {
+        if(xsi_num > 0) {
+            list[i].screen = &screens[DefaultScreen(dpy)];
+            list[i].x_org = xsi[i].x_org;
+            list[i].y_org = xsi[i].y_org;
+            list[i].width = xsi[i].width;
+            list[i].height = xsi[i].height;
+        } else {
+            list[i].screen = &screens[i];
+            list[i].x_org = 0;
+            list[i].y_org = 0;
+            list[i].width = DisplayWidth(dpy, i);
+            list[i].height = DisplayHeight(dpy, i);
+        }
+        layout_head(&list[i]);
+    }
+
+    free(active);
+    free(reply);
+    return list;
+}
+
+void layout_head(Head *h)
+{
+    XRectangle *r;
+
+    r = &h->message;
+    r->width = image_width[ImageMessage];
+    r->height = image_height[ImageMessage];
+    r->x = h->x_org + ((h->width * .5) - (r->width * .5));
+    r->y = h->y_org + ((h->height * .5) - (r->height * 2));
+
+    r = &h->field;
+    r->width = h->width - (h->width * .25);
+    r->height = h->height * .05;
+    r->x = h->x_org + ((h->width * .5) - (r->width * .5));
+    r->y = h->y_org + ((h->height * .5) - (r->height * .5));
+
+    h->iw = r->width - (FIELD_WEIGHT * 2);
+    h->ih = r->height - (FIELD_WEIGHT * 2);
+    h->ix = r->x + FIELD_WEIGHT;
+    h->iy = r->y + FIELD_WEIGHT;
+    h->dot_size = (h->iw / MAX_WILDCARDS) * .5;
+    h->dot_y = h->iy + ((h->ih * .5) - (h->dot_size * .5));
+
+    r = &h->banner;
+    r->width = MAX(image_width[ImageGranted], image_width[ImageDenied]);
+    r->height = MAX(image_height[ImageGranted], image_height[ImageDenied]);
+    r->x = h->x_org + ((h->width * .5) - (r->width * .5));
+    r->y = h->y_org + ((h->height * .5) + (r->height * 2));
+
+    h->drawn.message = h->drawn.field = h->drawn.dots = 0;
+    h->drawn.access = -1;
+}
+
+Head *find_head(Head *h, Head *list, int num)
+{
+    int i;
+
+    for(i = 0; i < num; i++)
+        if(list[i].screen == h->screen && list[i].x_org == h->x_org
+                && list[i].y_org == h->y_org && list[i].width == h->width
+                && list[i].height == h->height)
+            return &list[i];
+    return NULL;
+}
+
+void relayout(void)
+{
+    Head *old = heads, *h, *list;
+    int num_old = num_heads, num, n, i;
+
+    for(n = 0; n < num_screens; n++)
+        XMoveResizeWindow(dpy, screens[n].win, 0, 0,
+                DisplayWidth(dpy, n), DisplayHeight(dpy, n));
+    request_heads();
+    list = collect_heads(&num);
+
+    /* The workers render from the heads, keep them out while swapping */
+    lock_workers();
+    heads = list;
+    num_heads = num;
+
+    /* Heads that are still there keep what they show, areas of heads
+     * that are gone are cleared before the new heads are rendered */
+    for(i = 0; i < num_old; i++)
+        if(!find_head(&old[i], heads, num_heads))
+            XClearArea(dpy, old[i].screen->win, old[i].x_org, old[i].y_org,
+                    old[i].width, old[i].height, False);
+
+    for(i = 0; i < num_heads; i++)
+        if((h = find_head(&heads[i], old, num_old)))
+            heads[i].drawn = h->drawn;
+    unlock_workers();
+
+    /* Workers paint on their own connections, the clears must have been
+     * executed before or they could wipe what the workers draw */
+    if(num_workers)
+        sync_display(dpy);
+
+    info("Relayout to %d heads", num_heads);
+    free(old);
+    render();
+}
+
+int same_format(int a, int b)
+{
+    Visual *va = DefaultVisual(dpy, a), *vb = DefaultVisual(dpy, b);
+
+    /* The depth decides the bits per pixel, the visual their meaning */
+    return DefaultDepth(dpy, a) == DefaultDepth(dpy, b) && va->class == vb->class
+        && va->red_mask == vb->red_mask && va->green_mask == vb->green_mask
+        && va->blue_mask == vb->blue_mask;
+}
+
+void init_pixels(int n)
+{
+    Visual *v = DefaultVisual(dpy, n);
+    XImage *probe;
+    int bpp;
+
+    probe = XCreateImage(dpy, v, DefaultDepth(dpy, n), ZPixmap, 0, NULL, 1, 1, 32, 0);
+    if(!probe)
+        exit_error("Could not create image");
+    bpp = probe->bits_per_pixel;
+    free(probe);
+    pixel_screen = n;
+
+    /* Colormapped visuals have no masks to scale to, the images are
+     * drawn in the screen's black and white instead */
+    if(v->class != TrueColor && v->class != DirectColor) {
+        pixel_converter = convert_mono;
+        info("Pixel format of screen %d: monochrome", n);
+        return;
+    }
+
+    /* The specialized converters write host order, any other layout or
+     * byte order goes pixel by pixel through Xlib */
+    pixel_converter = convert_generic;
+    if(ImageByteOrder(dpy) == host_byte_order()) {
+        if(bpp == 32 && v->red_mask == 0xFF0000 && v->green_mask == 0xFF00
+                && v->blue_mask == 0xFF)
+            pixel_converter = NULL;
+        else if(bpp == 32 && v->red_mask == 0xFF && v->green_mask == 0xFF00
+                && v->blue_mask == 0xFF0000)
+            pixel_converter = convert_bgr888;
+        else if(bpp == 16 && v->red_mask == 0xF800 && v->green_mask == 0x7E0
+                && v->blue_mask == 0x1F)
+            pixel_converter = convert_rgb565;
+        else if(bpp == 32 && v->red_mask == 0x3FF00000 && v->green_mask == 0xFFC00
+                && v->blue_mask == 0x3FF)
+            pixel_converter = convert_rgb101010;
+    }
+
+    info("Pixel format of screen %d: %s", n, !pixel_converter ? "RGB888"
+            : pixel_converter == convert_bgr888 ? "BGR888"
+            : pixel_converter == convert_rgb565 ? "RGB565"
+            : pixel_converter == convert_rgb101010 ? "RGB101010" : "generic");
+}
+
+void convert_bgr888(XImage *image, const unsigned int *src, int y)
+{
+    unsigned int *dst = (unsigned int *)(image->data + (y * image->bytes_per_line));
+    unsigned int p;
+    int x;
+
+    for(x = 0; x < image->width; x++) {
+        p = src[x];
+        dst[x] = ((p & 0xFF) << 16) | (p & 0xFF00) | ((p >> 16) & 0xFF);
+    }
+}
+
+void convert_rgb565(XImage *image, const unsigned int *src, int y)
+{
+    unsigned short *dst = (unsigned short *)(image->data + (y * image->bytes_per_line));
+    unsigned int p;
+    int x;
+
+    for(x = 0; x < image->width; x++) {
+        p = src[x];
+        dst[x] = ((p >> 8) & 0xF800) | ((p >> 5) & 0x7E0) | ((p >> 3) & 0x1F);
+    }
+}
+
+void convert_rgb101010(XImage *image, const unsigned int *src, int y)
+{
+    unsigned int *dst = (unsigned int *)(image->data + (y * image->bytes_per_line));
+    unsigned int p, r, g, b;
+    int x;
+
+    /* Replicating the top bits keeps white at full intensity */
+    for(x = 0; x < image->width; x++) {
+        p = src[x];
+        r = (p >> 16) & 0xFF;
+        g = (p >> 8) & 0xFF;
+        b = p & 0xFF;
+        dst[x] = (((r << 2) | (r >> 6)) << 20) | (((g << 2) | (g >> 6)) << 10)
+            | ((b << 2) | (b >> 6));
+    }
+}
+
+void convert_generic(XImage *image, const unsigned int *src, int y)
+{
+    unsigned long masks[3], pixel;
+    unsigned int c;
+    int x, i, shift, max;
+
+    masks[0] = image->red_mask;
+    masks[1] = image->green_mask;
+    masks[2] = image->blue_mask;
+
+    for(x = 0; x < image->width; x++) {
+        pixel = 0;
+        for(i = 0; i < 3; i++) {
+            if(!masks[i])
+                continue;
+            for(shift = 0; !((masks[i] >> shift) & 1); shift++);
+            max = masks[i] >> shift;
+            c = (src[x] >> (16 - (i * 8))) & 0xFF;
+            pixel |= (((c * max) + 127) / 255) << shift;
+        }
+        XPutPixel(image, x, y, pixel);
+    }
+}
+
+void convert_mono(XImage *image, const unsigned int *src, int y)
+{
+    unsigned long black = BlackPixel(dpy, pixel_screen), white = WhitePixel(dpy, pixel_screen);
+    unsigned int p;
+    int x;
+
+    for(x = 0; x < image->width; x++) {
+        p = src[x];
+        XPutPixel(image, x, y, ((((p >> 16) & 0xFF) * 299) + (((p >> 8) & 0xFF) * 587)
+                    + ((p & 0xFF) * 114)) >= 128000 ? white : black);
+    }
+}
+
+void upload_images(void)
+{
+    XImage *image[ImageLast];
+    int n, i, shared = 1;
+
+    /* Screens of one pixel format share the encoded images, a mix of
+     * formats is encoded and put for every screen on its own */
+    for(n = 1; n < num_screens; n++)
+        shared = shared && same_format(0, n);
+
+    load_images(image, 0);
+
+    /* Upload every image once per screen, later draws are server side
+     * copies and the client side images are not needed anymore */
+    for(i = 0; i < ImageLast; i++) {
+        image_width[i] = image[i]->width;
+        image_height[i] = image[i]->height;
+        for(n = 0; n < num_screens; n++)
+            screens[n].images[i] = XCreatePixmap(dpy, screens[n].root,
+                    image_width[i], image_height[i], DefaultDepth(dpy, n));
+    }
+
+    /* Shared memory only works when the server is on the same host, which
+     * is verified by the attach */
+    use_shm = shared && shm_opcode && XShmQueryExtension(dpy) && shm_upload_images(image);
+    for(n = 0; n < num_screens && !use_shm; n++) {
+        if(n > 0 && !shared) {
+            free_images(image);
+            load_images(image, n);
+        }
+        put_images(image, n);
+    }
+    free_images(image);
+
+    trace_phase("upload");
+    info("Image upload path: %s", use_shm ? "MIT-SHM" : "XPutImage");
+}
+
+void load_images(XImage **image, int n)
+{
+    int i;
+
+    init_pixels(n);
+
+    image[ImageMessage] = load_ximage_message();
+    trace_phase("load-message");
+    image[ImageGranted] = load_ximage_granted();
+    trace_phase("load-granted");
+    image[ImageDenied] = load_ximage_denied();
+    trace_phase("load-denied");
+
+    for(i = 0; i < ImageLast; i++)
+        if(!image[i])
+            exit_error("Could not create image");
+}
+
+void put_images(XImage **image, int n)
+{
+    int i;
+
+    for(i = 0; i < ImageLast; i++)
+        XPutImage(dpy, screens[n].images[i], screens[n].gc, image[i],
+                0, 0, 0, 0, image_width[i], image_height[i]);
+}
+
+void free_images(XImage **image)
+{
+    int i;
+
+    /* Only encoded pixels are owned by the images */
+    for(i = 0; i < ImageLast; i++) {
+        if(pixel_converter)
+            free(image[i]->data);
+        free(image[i]);
+    }
+}
+
+int shm_upload_images(XImage **image)
+{
+    XShmSegmentInfo shminfo;
+    XImage *shmimage[ImageLast];
+    size_t size = 0;
+    int i, ok = 1;
+
+    /* All images share one segment, so the upload costs a single attach
+     * and a single round trip */
+    for(i = 0; i < ImageLast; i++) {
+        shmimage[i] = XShmCreateImage(dpy, XDefaultVisual(dpy, pixel_screen),
+                XDefaultDepth(dpy, pixel_screen), ZPixmap, NULL, &shminfo,
+                image[i]->width, image[i]->height);
+        if(!shmimage[i] || shmimage[i]->bytes_per_line != image[i]->bytes_per_line
+                || shmimage[i]->byte_order != image[i]->byte_order)
+            ok = 0;
+        else
+            size += shmimage[i]->bytes_per_line * shmimage[i]->height;
+    }
+
+    if(ok)
+        ok = shm_put_images(&shminfo, shmimage, image, size);
+
+    for(i = 0; i < ImageLast; i++) {
+        if(!shmimage[i])
+            continue;
+        shmimage[i]->data = NULL;
+        XDestroyImage(shmimage[i]);
+    }
+
+    return ok;
+}
+
+int shm_put_images(XShmSegmentInfo *shminfo, XImage **shmimage, XImage **image, size_t size)
+{
+    char *data;
+    int n, i;
+
+    if((shminfo->shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600)) < 0)
+        return 0;
+    shminfo->shmaddr = data = shmat(shminfo->shmid, NULL, 0);
+    if(shminfo->shmaddr == (char *)-1) {
+        shmctl(shminfo->shmid, IPC_RMID, NULL);
+        return 0;
+    }
+    shminfo->readOnly = True;
+    for(i = 0; i < ImageLast; i++) {
+        shmimage[i]->data = data;
+        memcpy(data, image[i]->data, image[i]->bytes_per_line * image[i]->height);
+        data += shmimage[i]->bytes_per_line * shmimage[i]->height;
+    }
+
+    /* A remote server fails the attach, trap the error instead of
+     * exiting and let the caller fall back to XPutImage */
+    shm_error = 0;
+    shm_next_handler = XSetErrorHandler(shm_error_handler);
+    XShmAttach(dpy, shminfo);
+    sync_display(dpy);
+    XSetErrorHandler(shm_next_handler);
+
+    /* Only removed once the server has attached it, not every system
+     * lets a segment marked for removal be attached. It lives on until
+     * the server detaches */
+    shmctl(shminfo->shmid, IPC_RMID, NULL);
+
+    if(!shm_error) {
+        for(i = 0; i < ImageLast; i++)
+            for(n = 0; n < num_screens; n++)
+                XShmPutImage(dpy, screens[n].images[i], screens[n].gc, shmimage[i],
+                        0, 0, 0, 0, image[i]->width, image[i]->height, False);
+        XShmDetach(dpy, shminfo);
+    }
+    shmdt(shminfo->shmaddr);
+
+    return !shm_error;
+}
+
+int shm_error_handler(Display *d, XErrorEvent *e)
+{
+    /* Errors of other requests caught by the sync are not the attach's */
+    if(e->request_code != shm_opcode)
+        return shm_next_handler(d, e);
+    shm_error = 1;
+    return 0;
 }
 
 void init_graphics(void)
 {
-    draw_message(0);
-    draw_inputfield(0);
-    draw_input(1);
     activated = 1;
+    render();
     toggle_dpms();
+    XChangeActivePointerGrab(dpy, pointer_events(), blank_cursor, CurrentTime);
 }
 
 void clear_graphics(void)
 {
-    int n;
-    for(n = 0; n < num_screens; n++)
-        XClearWindow(dpy, screens[n].win);
     activated = 0;
+    blanked_at = now_us();
+    /* A wake up starts over with the message, not the last result */
+    access_result = -1;
+    render();
     toggle_dpms();
+    XChangeActivePointerGrab(dpy, pointer_events(), blank_cursor, CurrentTime);
 }
 
-void draw_message(int direct)
+void render(void)
 {
-    int n, x, y;
-    for(n = 0; n < num_screens; n++) {
-        x = screens[n].x_org + ((screens[n].width * .5) - (message->width * .5));
-        y = screens[n].y_org + ((screens[n].height * .5) - (message->height * 2));
-        XPutImage(dpy, screens[n].win, screens[n].gc, message, 0, 0, x, y,
-                message->width, message->height);
+    Scene want;
+    int n;
+
+    wanted_scene(&want);
+
+    if(num_workers) {
+        for(n = 0; n < num_workers; n++)
+            post_worker(&workers[n], &want);
+    } else {
+        for(n = 0; n < num_heads; n++)
+            render_head(&heads[n], &want, &painter);
     }
 
-    if(direct)
-        update_screens();
+    update_screens();
 }
 
-void draw_inputfield(int direct)
+void wanted_scene(Scene *want)
 {
-    int weight = 3;
-    int n, w, h, x, y;
+    want->message = want->field = activated;
+    want->dots = verifying ? DOTS_VERIFYING : MIN(inputlen, MAX_WILDCARDS);
+    want->access = activated ? access_result : -1;
+}
 
-    for(n = 0; n < num_screens; n++) {
-        w = screens[n].width - (screens[n].width * .25);
-        h = screens[n].height * .05;
-        x = screens[n].x_org + ((screens[n].width * .5) - (w * .5));
-        y = screens[n].y_org + ((screens[n].height * .5) - (h * .5));
-        XSetForeground(dpy, screens[n].gc, fgcolor);
-        XFillRectangle(dpy, screens[n].win, screens[n].gc, x, y, w, h);
+void render_head(Head *h, Scene *want, Painter *p)
+{
+    Scene *d = &h->drawn;
 
-        screens[n].iw = w - (weight * 2);
-        screens[n].ih = h - (weight * 2);
-        screens[n].ix = x + weight;
-        screens[n].iy = y + weight;
-        XSetForeground(dpy, screens[n].gc, bgcolor);
-        XFillRectangle(dpy, screens[n].win, screens[n].gc,
-                screens[n].ix, screens[n].iy,screens[n].iw, screens[n].ih);
+    /* Going blank clears the whole head instead of single elements */
+    if(!want->message && (d->message || d->field || d->access >= 0)) {
+        XClearArea(p->dpy, h->screen->win, h->x_org, h->y_org,
+                h->width, h->height, False);
+        layout_head(h);
     }
 
-    if(direct)
-        update_screens();
+    if(want->message && !d->message)
+        paint_message(h, p);
+    if(want->field && !d->field)
+        paint_inputfield(h, p);
+    if(want->field && d->dots != want->dots)
+        paint_dots(h, want->dots, p);
+    if(d->access != want->access)
+        paint_access(h, want->access, p);
 }
 
-void draw_access_blank(int direct)
+void paint_message(Head *h, Painter *p)
 {
-    int n, x, y;
+    XScreen *s = h->screen;
 
-    for(n = 0; n < num_screens; n++) {
-        x = screens[n].x_org + ((screens[n].width * .5) - (granted->width * .5));
-        y = screens[n].y_org + ((screens[n].height * .5) + (granted->width * 2));
-        XSetForeground(dpy, screens[n].gc, bgcolor);
-        XFillRectangle(dpy, screens[n].win, screens[n].gc, x, y,
-                granted->width, granted->height);
-    }
+    XCopyArea(p->dpy, s->images[ImageMessage], s->win, p->gc[s->n], 0, 0,
+            h->message.width, h->message.height, h->message.x, h->message.y);
+    h->drawn.message = 1;
+}
 
-    if(direct)
-        update_screens();
+void paint_inputfield(Head *h, Painter *p)
+{
+    XScreen *s = h->screen;
+
+    XSetForeground(p->dpy, p->gc[s->n], fgcolor);
+    XFillRectangle(p->dpy, s->win, p->gc[s->n], h->field.x, h->field.y,
+            h->field.width, h->field.height);
+    XSetForeground(p->dpy, p->gc[s->n], bgcolor);
+    XFillRectangle(p->dpy, s->win, p->gc[s->n], h->ix, h->iy, h->iw, h->ih);
+    h->drawn.field = 1;
+    h->drawn.dots = 0;
 }
 
-void draw_access(XImage *image, int direct)
+void paint_dots(Head *h, int len, Painter *p)
 {
-    int n, x, y;
+    XScreen *s = h->screen;
+    XRectangle dots[MAX_WILDCARDS];
+    int i, from, step;
 
-    draw_access_blank(0);
+    if(len == DOTS_VERIFYING) {
+        paint_verifying(h, p);
+        return;
+    }
 
-    for(n = 0; n < num_screens; n++) {
-        x = screens[n].x_org + ((screens[n].width * .5) - (image->width * .5));
-        y = screens[n].y_org + ((screens[n].height * .5) + (image->height * 2));
-        XPutImage(dpy, screens[n].win, screens[n].gc, image, 0, 0, x, y,
-                image->width, image->height);
+    step = h->iw / ((fixed_slots ? MAX_WILDCARDS : len) + 1);
+
+    if(!fixed_slots || len == 0 || h->drawn.dots == DOTS_VERIFYING) {
+        /* Spread out wildcards all move when the count changes */
+        XSetForeground(p->dpy, p->gc[s->n], bgcolor);
+        XFillRectangle(p->dpy, s->win, p->gc[s->n], h->ix, h->iy, h->iw, h->ih);
+        from = 0;
+    } else if(len < h->drawn.dots) {
+        /* Only clear the slots of the removed wildcards */
+        XSetForeground(p->dpy, p->gc[s->n], bgcolor);
+        XFillRectangle(p->dpy, s->win, p->gc[s->n], h->ix + (step * (len + 1)), h->dot_y,
+                (step * (h->drawn.dots - len - 1)) + h->dot_size, h->dot_size);
+        h->drawn.dots = len;
+        return;
+    } else {
+        from = h->drawn.dots;
     }
 
-    if(direct)
-        update_screens();
+    for(i = from; i < len; i++) {
+        dots[i - from].x = h->ix + (step * (i + 1));
+        dots[i - from].y = h->dot_y;
+        dots[i - from].width = h->dot_size;
+        dots[i - from].height = h->dot_size;
+    }
+    if(len > from) {
+        XSetForeground(p->dpy, p->gc[s->n], fgcolor);
+        XFillRectangles(p->dpy, s->win, p->gc[s->n], dots, len - from);
+    }
+    h->drawn.dots = len;
 }
 
-void draw_input(int direct)
+void paint_verifying(Head *h, Painter *p)
 {
-    int n, i, len, y, size, step;
+    XScreen *s = h->screen;
+    int size;
+
+    /* A bar through the field while the access check is running */
+    size = (h->iw / MAX_WILDCARDS) * .25;
+    XSetForeground(p->dpy, p->gc[s->n], bgcolor);
+    XFillRectangle(p->dpy, s->win, p->gc[s->n], h->ix, h->iy, h->iw, h->ih);
+    XSetForeground(p->dpy, p->gc[s->n], fgcolor);
+    XFillRectangle(p->dpy, s->win, p->gc[s->n], h->ix, h->iy + ((h->ih * .5) - (size * .5)),
+            h->iw, size);
+    h->drawn.dots = DOTS_VERIFYING;
+}
 
-    for(n = 0; n < num_screens; n++) {
-        XSetForeground(dpy, screens[n].gc, bgcolor);
-        XFillRectangle(dpy, screens[n].win, screens[n].gc,
-                screens[n].ix, screens[n].iy, screens[n].iw, screens[n].ih);
+void paint_access(Head *h, int image, Painter *p)
+{
+    XScreen *s = h->screen;
+    int x;
+
+    if(h->drawn.access >= 0) {
+        XSetForeground(p->dpy, p->gc[s->n], bgcolor);
+        XFillRectangle(p->dpy, s->win, p->gc[s->n], h->banner.x, h->banner.y,
+                h->banner.width, h->banner.height);
+    }
+    if(image >= 0) {
+        x = h->x_org + ((h->width * .5) - (image_width[image] * .5));
+        XCopyArea(p->dpy, s->images[image], s->win, p->gc[s->n], 0, 0,
+                image_width[image], image_height[image], x, h->banner.y);
+    }
+    h->drawn.access = image;
+}
+
+void add_damage(XExposeEvent *e)
+{
+    XScreen *s = NULL;
+    XRectangle *d;
+    int n, x2, y2;
+
+    for(n = 0; n < num_screens; n++)
+        if(screens[n].win == e->window)
+            s = &screens[n];
+    if(!s)
+        return;
+
+    /* Grow the damage to the union of all exposed rectangles */
+    d = &s->damage;
+    if(!s->damaged) {
+        d->x = e->x;
+        d->y = e->y;
+        d->width = e->width;
+        d->height = e->height;
+        s->damaged = 1;
+    } else {
+        x2 = MAX(d->x + d->width, e->x + e->width);
+        y2 = MAX(d->y + d->height, e->y + e->height);
+        d->x = MIN(d->x, e->x);
+        d->y = MIN(d->y, e->y);
+        d->width = x2 - d->x;
+        d->height = y2 - d->y;
+    }
+
+    /* More exposes of this window follow, repaint once they are in */
+    if(e->count == 0)
+        repaint_damage(s);
+}
 
-        XSetForeground(dpy, screens[n].gc, fgcolor);
-        len = (inputlen < MAX_WILDCARDS ? inputlen : MAX_WILDCARDS) + 1;
+void repaint_damage(XScreen *s)
+{
+    XRectangle *d = &s->damage;
+    Scene want;
+    Head *h;
+    int n;
 
-        size = (screens[n].iw / MAX_WILDCARDS) * .5;
-        y = screens[n].iy + ((screens[n].ih * .5) - (size * .5));
-        step = screens[n].iw / len;
+    /* Forget what was exposed and render it again, clipped to the
+     * damage so the rest of the elements stays untouched. Workers
+     * repaint the forgotten elements whole, their GCs are not clipped */
+    lock_workers();
+    for(n = 0; n < num_heads; n++) {
+        h = &heads[n];
+        if(h->screen != s)
+            continue;
+        if(INTERSECTS(h->message, *d))
+            h->drawn.message = 0;
+        if(INTERSECTS(h->field, *d))
+            h->drawn.field = 0;
+        if(INTERSECTS(h->banner, *d))
+            h->drawn.access = -1;
+    }
+    unlock_workers();
+    s->damaged = 0;
 
-        for(i = 1; i < len; i++)
-            XFillRectangle(dpy, screens[n].win, screens[n].gc,
-                    screens[n].ix + (step * i), y, size, size);
+    if(num_workers) {
+        render();
+        return;
     }
 
-    if(direct)
-        update_screens();
+    wanted_scene(&want);
+    XSetClipRectangles(dpy, s->gc, 0, 0, d, 1, Unsorted);
+    for(n = 0; n < num_heads; n++)
+        if(heads[n].screen == s)
+            render_head(&heads[n], &want, &painter);
+    XSetClipMask(dpy, s->gc, None);
+    update_screens();
 }
 
 void update_screens(void)
 {
     XFlush(dpy);
+    if(trace_key >= 0)
+        trace_frame();
+}
+
+void start_workers(void)
+{
+    XGCValues gcv;
+    Worker *w;
+    int n, i, num;
+
+    /* The pixmaps and windows must exist before other connections use them */
+    sync_display(dpy);
+
+    /* Only started workers are counted, cleanup stops just those */
+    num = MIN(num_heads, MAX_WORKERS);
+    workers = calloc(num, sizeof(Worker));
+    for(n = 0; n < num; n++) {
+        w = &workers[n];
+        if(!(w->p.dpy = XOpenDisplay(DisplayString(dpy))))
+            exit_error("Could not open display for render worker %d", n);
+        w->p.gc = malloc(sizeof(GC) * num_screens);
+        gcv.graphics_exposures = False;
+        for(i = 0; i < num_screens; i++)
+            w->p.gc[i] = XCreateGC(w->p.dpy, screens[i].win, GCGraphicsExposures, &gcv);
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->cond, NULL);
+        if(pthread_create(&w->thread, NULL, worker_main, w))
+            exit_error("Could not start render worker %d", n);
+        num_workers++;
+    }
+    info("Rendering %d heads with %d workers", num_heads, num_workers);
+}
+
+void stop_workers(void)
+{
+    Worker *w;
+    int n, i;
+
+    for(n = 0; n < num_workers; n++) {
+        w = &workers[n];
+        pthread_mutex_lock(&w->lock);
+        w->quit = 1;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->thread, NULL);
+
+        for(i = 0; i < num_screens; i++)
+            XFreeGC(w->p.dpy, w->p.gc[i]);
+        free(w->p.gc);
+        XCloseDisplay(w->p.dpy);
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->cond);
+    }
+    free(workers);
+    workers = NULL;
+    num_workers = 0;
+}
+
+void *worker_main(void *arg)
+{
+    Worker *w = arg;
+    int n;
+
+    pthread_mutex_lock(&w->lock);
+    for(;;) {
+        while(!w->pending && !w->quit)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if(w->quit)
+            break;
+
+        for(n = w - workers; n < num_heads; n += num_workers)
+            render_head(&heads[n], &w->want, &w->p);
+        XFlush(w->p.dpy);
+
+        w->pending = 0;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+void post_worker(Worker *w, Scene *want)
+{
+    /* Only the latest scene matters, a worker still busy skips the
+     * ones posted in between */
+    pthread_mutex_lock(&w->lock);
+    w->want = *want;
+    w->pending = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+void lock_workers(void)
+{
+    int n;
+
+    for(n = 0; n < num_workers; n++)
+        pthread_mutex_lock(&workers[n].lock);
+}
+
+void unlock_workers(void)
+{
+    int n;
+
+    for(n = num_workers - 1; n >= 0; n--)
+        pthread_mutex_unlock(&workers[n].lock);
+}
+
+void sync_render(void)
+{
+    Worker *w;
+    int n;
+
+    /* Wait until every posted scene has reached the server */
+    for(n = 0; n < num_workers; n++) {
+        w = &workers[n];
+        pthread_mutex_lock(&w->lock);
+        while(w->pending)
+            pthread_cond_wait(&w->cond, &w->lock);
+        sync_display(w->p.dpy);
+        pthread_mutex_unlock(&w->lock);
+    }
+    sync_display(dpy);
 }
 
 int check_input(void)
 {
-    int access_granted;
+    int fds[2], n;
 
     input[inputlen] = '\0';
-    draw_access_blank(1);
+    input_dirty = 0;
+    verifying = 1;
+    access_result = -1;
+    render();
+
+    /* The check runs in a child so the event loop keeps going, the
+     * result is read from the pipe once the child is done */
+    auth_pid = -1;
+    if(pipe(fds) == 0) {
+        if(watch_fd(fds[0], check_result) == 0 && (auth_pid = fork()) == 0) {
+            close(ConnectionNumber(dpy));
+            close(fds[0]);
+            sigprocmask(SIG_UNBLOCK, &signal_mask, NULL);
+            n = authenticate();
+            write(fds[1], &n, sizeof n);
+            _exit(EXIT_SUCCESS);
+        }
+        close(fds[1]);
+        if(auth_pid > 0) {
+            auth_fd = fds[0];
+        } else {
+            unwatch_fd(fds[0]);
+            close(fds[0]);
+        }
+    }
 
-#ifdef TEST
-    access_granted = strcmp(input, "test") == 0;
-#else
-    access_granted = pam_check_access();
-#endif
+    /* Without a child the check has to block */
+    n = auth_fd < 0 ? authenticate() : 0;
 
     while(inputlen)
         input[--inputlen] = '\0';
 
+    return auth_fd < 0 ? check_done(n) : 0;
+}
+
+int check_result(void)
+{
+    int access_granted = 0;
+
+    if(read(auth_fd, &access_granted, sizeof access_granted) != sizeof access_granted)
+        access_granted = 0;
+    unwatch_fd(auth_fd);
+    close(auth_fd);
+    auth_fd = -1;
+    waitpid(auth_pid, NULL, 0);
+
+    return check_done(access_granted);
+}
+
+int check_done(int access_granted)
+{
+    verifying = 0;
     if(access_granted) {
-        draw_access(granted, 1);
-        sleep(1);
-    } else {
-        draw_access(denied, 1);
+        if(grant_time <= 0)
+            return 1;
+        /* The event loop unlocks when the timer expires */
+        access_result = ImageGranted;
+        render();
+        arm_timer(unlock_fd, grant_time);
+        unlocking = 1;
+        return 0;
     }
 
-    return access_granted;
+    failed_attempts++;
+    access_result = ImageDenied;
+    render();
+    return 0;
+}
+
+int authenticate(void)
+{
+#ifdef TEST
+    return strcmp(input, "test") == 0;
+#else
+    return pam_check_access();
+#endif
 }
 
 int pam_check_access()